@@ -0,0 +1,478 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+/*
+ * Benchmark suite
+ *
+ * Formats a scratch disk image, runs a set of standard workloads on it and
+ * reports throughput and per-operation latency percentiles, as a table, CSV
+ * or JSON, so that runs before and after a libfs change can be compared.
+ */
+
+#define DATA_BLOCKS	8192
+#define FILE_BYTES	(16 << 20)
+#define RAND_OPS	2048
+#define MOUNT_ROUNDS	64
+#define MAX_IO		(1 << 20)
+
+#define die(...)				\
+do {						\
+	fprintf(stderr, __VA_ARGS__);		\
+	fprintf(stderr, "\n");			\
+	exit(1);				\
+} while (0)
+
+enum format { TEXT, CSV, JSON };
+
+/* Outcome of one workload */
+struct result {
+	const char *name;
+	size_t io_size;
+	size_t ops;
+	size_t bytes;
+	double secs;
+	double p50, p99, p999;	/* Latencies, in microseconds */
+};
+
+/* Per-operation latencies of the running workload, in nanoseconds */
+static uint64_t *lat;
+static size_t nlat;
+static size_t lat_cap;
+
+static char *diskname = "bench.fs";
+static int mount_flags;
+static enum format format = TEXT;
+static const char *filter;
+static int printed;
+static char buf[MAX_IO];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lat_add(uint64_t ns)
+{
+	if (nlat == lat_cap) {
+		lat_cap = lat_cap ? lat_cap * 2 : 1024;
+		lat = realloc(lat, lat_cap * sizeof(*lat));
+		if (!lat)
+			die("Out of memory");
+	}
+	lat[nlat++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(double q)
+{
+	size_t i = q * nlat;
+
+	if (nlat == 0)
+		return 0;
+	if (i >= nlat)
+		i = nlat - 1;
+	return lat[i] / 1e3;
+}
+
+static void do_mount(void)
+{
+	if (fs_mount_flags(diskname, mount_flags))
+		die("Cannot mount %s", diskname);
+}
+
+static void do_umount(void)
+{
+	if (fs_umount())
+		die("Cannot unmount %s", diskname);
+}
+
+static int open_file(const char *name, int create)
+{
+	int fd;
+
+	if (create && fs_create(name))
+		die("Cannot create %s", name);
+	fd = fs_open(name);
+	if (fd < 0)
+		die("Cannot open %s", name);
+	return fd;
+}
+
+static void report(struct result *r)
+{
+	double mbs = r->secs > 0 ? r->bytes / r->secs / (1 << 20) : 0;
+	double opss = r->secs > 0 ? r->ops / r->secs : 0;
+
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+	r->p50 = percentile(0.50);
+	r->p99 = percentile(0.99);
+	r->p999 = percentile(0.999);
+
+	switch (format) {
+	case TEXT:
+		if (!printed)
+			printf("%-14s %8s %8s %10s %10s %10s %10s %10s\n",
+			       "workload", "io", "ops", "MB/s", "ops/s",
+			       "p50(us)", "p99(us)", "p999(us)");
+		printf("%-14s %8zu %8zu %10.1f %10.0f %10.1f %10.1f %10.1f\n",
+		       r->name, r->io_size, r->ops, mbs, opss,
+		       r->p50, r->p99, r->p999);
+		break;
+	case CSV:
+		if (!printed)
+			printf("workload,io_size,ops,bytes,secs,mb_per_s,"
+			       "ops_per_s,p50_us,p99_us,p999_us\n");
+		printf("%s,%zu,%zu,%zu,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+		       r->name, r->io_size, r->ops, r->bytes, r->secs, mbs,
+		       opss, r->p50, r->p99, r->p999);
+		break;
+	case JSON:
+		printf("%s\n  {\"workload\": \"%s\", \"io_size\": %zu, "
+		       "\"ops\": %zu, \"bytes\": %zu, \"secs\": %.6f, "
+		       "\"mb_per_s\": %.3f, \"ops_per_s\": %.3f, "
+		       "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}",
+		       printed ? "," : "[", r->name, r->io_size, r->ops,
+		       r->bytes, r->secs, mbs, opss, r->p50, r->p99, r->p999);
+		break;
+	}
+	printed = 1;
+	fflush(stdout);
+}
+
+/* Run a workload on a freshly formatted disk, unless it is filtered out */
+static void bench(const char *name, size_t io_size,
+		  void (*fn)(struct result *))
+{
+	struct result r = { name, io_size, 0, 0, 0, 0, 0, 0 };
+
+	if (filter && !strstr(name, filter))
+		return;
+
+	if (fs_format(diskname, DATA_BLOCKS))
+		die("Cannot format %s", diskname);
+	nlat = 0;
+	fn(&r);
+	report(&r);
+}
+
+/* Time a whole workload */
+#define TIMED(r, body)						\
+do {								\
+	uint64_t _start = now_ns();				\
+	body;							\
+	(r)->secs = (now_ns() - _start) / 1e9;			\
+} while (0)
+
+/* Time one of its operations, recorded for the latency percentiles */
+#define OP(body)						\
+do {								\
+	uint64_t _t = now_ns();					\
+	body;							\
+	lat_add(now_ns() - _t);					\
+} while (0)
+
+/* Write FILE_BYTES sequentially, sync included */
+static void seq_write(struct result *r)
+{
+	int fd;
+
+	do_mount();
+	fd = open_file("seq", 1);
+	TIMED(r, {
+		for (size_t off = 0; off < FILE_BYTES; off += r->io_size) {
+			OP(if (fs_write(fd, buf, r->io_size) != (int)r->io_size)
+				die("Short write"));
+			r->ops++;
+		}
+		if (fs_sync())
+			die("Cannot sync");
+	});
+	r->bytes = FILE_BYTES;
+	fs_close(fd);
+	do_umount();
+}
+
+/*
+ * Write FILE_BYTES as records of a 32-byte header, an io_size payload and an
+ * 8-byte trailer, each record with one fs_writev() call, sync included
+ */
+static void writev_records(struct result *r)
+{
+	size_t record = 32 + r->io_size + 8;
+	struct iovec iov[3];
+	int fd;
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 32;
+	iov[1].iov_base = buf + 32;
+	iov[1].iov_len = r->io_size;
+	iov[2].iov_base = buf + 32 + r->io_size;
+	iov[2].iov_len = 8;
+
+	do_mount();
+	fd = open_file("records", 1);
+	TIMED(r, {
+		for (size_t off = 0; off + record <= FILE_BYTES; off += record) {
+			OP(if (fs_writev(fd, iov, 3) != (int)record)
+				die("Short write"));
+			r->ops++;
+		}
+		if (fs_sync())
+			die("Cannot sync");
+	});
+	r->bytes = r->ops * record;
+	fs_close(fd);
+	do_umount();
+}
+
+/* Lay out a FILE_BYTES file, then remount so that the cache starts cold */
+static int prepare_file(void)
+{
+	int fd;
+
+	do_mount();
+	fd = open_file("data", 1);
+	for (size_t off = 0; off < FILE_BYTES; off += MAX_IO)
+		if (fs_write(fd, buf, MAX_IO) != MAX_IO)
+			die("Short write");
+	fs_close(fd);
+	do_umount();
+
+	do_mount();
+	return open_file("data", 0);
+}
+
+static void seq_read(struct result *r)
+{
+	int fd = prepare_file();
+
+	TIMED(r, {
+		for (size_t off = 0; off < FILE_BYTES; off += r->io_size) {
+			OP(if (fs_read(fd, buf, r->io_size) != (int)r->io_size)
+				die("Short read"));
+			r->ops++;
+		}
+	});
+	r->bytes = FILE_BYTES;
+	fs_close(fd);
+	do_umount();
+}
+
+static void rand_read(struct result *r)
+{
+	int fd = prepare_file();
+	unsigned int seed = 1;
+
+	TIMED(r, {
+		for (int i = 0; i < RAND_OPS; i++) {
+			size_t off = rand_r(&seed) % (FILE_BYTES / r->io_size);
+
+			OP(if (fs_lseek(fd, off * r->io_size) ||
+			       fs_read(fd, buf, r->io_size) != (int)r->io_size)
+				die("Short read"));
+			r->ops++;
+		}
+	});
+	r->bytes = r->ops * r->io_size;
+	fs_close(fd);
+	do_umount();
+}
+
+/* Read random aligned chunks of an existing file without seeking */
+static void rand_pread(struct result *r)
+{
+	int fd = prepare_file();
+	unsigned int seed = 1;
+
+	TIMED(r, {
+		for (int i = 0; i < RAND_OPS; i++) {
+			size_t off = rand_r(&seed) % (FILE_BYTES / r->io_size);
+
+			OP(if (fs_pread(fd, buf, r->io_size, off * r->io_size) !=
+			       (int)r->io_size)
+				die("Short read"));
+			r->ops++;
+		}
+	});
+	r->bytes = r->ops * r->io_size;
+	fs_close(fd);
+	do_umount();
+}
+
+/* Overwrite random parts of an existing file, sync included */
+static void rand_write(struct result *r)
+{
+	int fd = prepare_file();
+	unsigned int seed = 1;
+
+	TIMED(r, {
+		for (int i = 0; i < RAND_OPS; i++) {
+			size_t off = rand_r(&seed) % (FILE_BYTES / r->io_size);
+
+			OP(if (fs_lseek(fd, off * r->io_size) ||
+			       fs_write(fd, buf, r->io_size) != (int)r->io_size)
+				die("Short write"));
+			r->ops++;
+		}
+		if (fs_sync())
+			die("Cannot sync");
+	});
+	r->bytes = r->ops * r->io_size;
+	fs_close(fd);
+	do_umount();
+}
+
+/*
+ * Fill the root directory with small files, then delete them all, a few
+ * times over. One operation is a create/open/write/close or a delete.
+ */
+static void churn(struct result *r)
+{
+	char name[FS_FILENAME_LEN];
+	int fd;
+
+	do_mount();
+	TIMED(r, {
+		for (int round = 0; round < 8; round++) {
+			for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+				snprintf(name, sizeof(name), "f%d", i);
+				OP({
+					fd = open_file(name, 1);
+					if (fs_write(fd, buf, r->io_size) !=
+					    (int)r->io_size)
+						die("Short write");
+					fs_close(fd);
+				});
+				r->ops++;
+			}
+			for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+				snprintf(name, sizeof(name), "f%d", i);
+				OP(if (fs_delete(name))
+					die("Cannot delete %s", name));
+				r->ops++;
+			}
+		}
+		if (fs_sync())
+			die("Cannot sync");
+	});
+	r->bytes = r->ops / 2 * r->io_size;
+	do_umount();
+}
+
+/* Append to one file until the disk is full */
+static void append_full(struct result *r)
+{
+	int fd, n;
+
+	do_mount();
+	fd = open_file("append", 1);
+	TIMED(r, {
+		do {
+			OP(n = fs_write(fd, buf, r->io_size));
+			r->bytes += n;
+			r->ops++;
+		} while (n == (int)r->io_size);
+		if (fs_sync())
+			die("Cannot sync");
+	});
+	fs_close(fd);
+	do_umount();
+}
+
+/* Mount and unmount a disk holding a large file */
+static void mount_umount(struct result *r)
+{
+	fs_close(prepare_file());
+	do_umount();
+
+	TIMED(r, {
+		for (int i = 0; i < MOUNT_ROUNDS; i++) {
+			OP({
+				do_mount();
+				do_umount();
+			});
+			r->ops++;
+		}
+	});
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [<option>...]\n", program);
+	fprintf(stderr, "Possible options are:\n");
+	fprintf(stderr, "\t--disk <file>\tscratch disk image (default %s)\n",
+		diskname);
+	fprintf(stderr, "\t--only <name>\trun the workloads whose name contains <name>\n");
+	fprintf(stderr, "\t--csv\treport as CSV\n");
+	fprintf(stderr, "\t--json\treport as JSON\n");
+	fprintf(stderr, "\t--mmap, --uring, --journal, --lazy\tmount flags, see test_fs.x\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t seq_sizes[] = { 4096, 65536, 1 << 20 };
+	static const size_t rand_sizes[] = { 512, 4096, 65536 };
+	char *program = argv[0];
+
+	for (argc--, argv++; argc > 0; argc--, argv++) {
+		if (!strcmp(argv[0], "--disk") && argc > 1) {
+			diskname = *++argv;
+			argc--;
+		} else if (!strcmp(argv[0], "--only") && argc > 1) {
+			filter = *++argv;
+			argc--;
+		} else if (!strcmp(argv[0], "--csv")) {
+			format = CSV;
+		} else if (!strcmp(argv[0], "--json")) {
+			format = JSON;
+		} else if (!strcmp(argv[0], "--mmap")) {
+			mount_flags |= FS_MOUNT_MMAP;
+		} else if (!strcmp(argv[0], "--uring")) {
+			mount_flags |= FS_MOUNT_URING;
+		} else if (!strcmp(argv[0], "--journal")) {
+			mount_flags |= FS_MOUNT_JOURNAL;
+		} else if (!strcmp(argv[0], "--lazy")) {
+			mount_flags |= FS_MOUNT_LAZY;
+		} else {
+			usage(program);
+		}
+	}
+
+	memset(buf, 0xA5, sizeof(buf));
+
+	for (size_t i = 0; i < sizeof(seq_sizes) / sizeof(*seq_sizes); i++)
+		bench("seq_write", seq_sizes[i], seq_write);
+	for (size_t i = 0; i < sizeof(seq_sizes) / sizeof(*seq_sizes); i++)
+		bench("seq_read", seq_sizes[i], seq_read);
+	bench("writev_records", 4000, writev_records);
+	for (size_t i = 0; i < sizeof(rand_sizes) / sizeof(*rand_sizes); i++)
+		bench("rand_read", rand_sizes[i], rand_read);
+	for (size_t i = 0; i < sizeof(rand_sizes) / sizeof(*rand_sizes); i++)
+		bench("rand_pread", rand_sizes[i], rand_pread);
+	for (size_t i = 0; i < sizeof(rand_sizes) / sizeof(*rand_sizes); i++)
+		bench("rand_write", rand_sizes[i], rand_write);
+	bench("churn", 4096, churn);
+	bench("append_full", 65536, append_full);
+	bench("mount_umount", 0, mount_umount);
+
+	if (format == JSON)
+		printf(printed ? "\n]\n" : "[]\n");
+
+	free(lat);
+	return 0;
+}
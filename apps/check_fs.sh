@@ -0,0 +1,205 @@
+#!/bin/sh
+#
+# Regression checks of test_fs.x, run by `make check` from apps/
+#
+
+APPS=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
+
+# Host file of $2 blocks of random data
+host_file() {
+	head -c $(($2 * 4096)) /dev/urandom > "$1"
+}
+
+# The reference implementation reads file $2 of image $1 as host file $3
+ref_cmp() {
+	"$APPS"/fs_ref.x cat "$1" "$2" > "$TMP/ref" || fail "fs_ref cat $2"
+	tail -c "$(wc -c < "$3")" "$TMP/ref" | cmp -s - "$3" ||
+		fail "$2 differs for fs_ref.x"
+}
+
+# The reference implementation agrees with test_fs.x, run with option $2 if
+# any, on the layout and the free blocks and slots of image $1
+ref_info() {
+	"$APPS"/fs_ref.x info "$1" > "$TMP/ref" || fail "fs_ref info"
+	"$APPS"/test_fs.x $2 info "$1" | head -n "$(wc -l < "$TMP/ref")" |
+		cmp -s - "$TMP/ref" || fail "fs_ref.x info differs"
+}
+
+# Defragmenting packs the files around a journal sitting at the start of the
+# data blocks
+check_defrag_journal() {
+	img=$TMP/defrag.fs
+
+	"$APPS"/fs_make.x "$img" 160 > /dev/null || fail "fs_make"
+	host_file "$TMP/head" 16
+	host_file "$TMP/tail" 143
+	"$APPS"/test_fs.x add "$img" head tail > /dev/null ||
+		fail "add"
+	"$APPS"/test_fs.x rm "$img" head > /dev/null || fail "rm"
+	# Only the first blocks are free for the journal
+	"$APPS"/test_fs.x --journal rm "$img" tail > /dev/null || fail "rm"
+
+	for i in 0 1 2 3 4 5 6 7 8 9; do
+		host_file "$TMP/c$i" 4
+		"$APPS"/test_fs.x --journal add "$img" c$i > /dev/null ||
+			fail "add"
+	done
+	for i in 0 2 4 6 8; do
+		"$APPS"/test_fs.x --journal rm "$img" c$i > /dev/null || fail "rm"
+	done
+	# Too large for the free run at the end, so it fills the holes
+	host_file "$TMP/big" 110
+	"$APPS"/test_fs.x --journal add "$img" big > /dev/null ||
+		fail "add"
+
+	"$APPS"/test_fs.x --journal defrag "$img" 16 > "$TMP/out" ||
+		fail "defrag"
+	grep -q "^after: .*, 0 fragmented, .* score 0.000$" "$TMP/out" ||
+		fail "files still fragmented: $(tail -n 1 "$TMP/out")"
+
+	"$APPS"/test_fs.x --journal export "$img" "$TMP/out.d" > /dev/null ||
+		fail "export"
+	for f in big c1 c3 c5 c7 c9; do
+		cmp -s "$TMP/$f" "$TMP/out.d/$f" || fail "$f changed by defrag"
+		ref_cmp "$img" $f "$TMP/$f"
+	done
+	ref_info "$img"
+}
+
+# Defragmenting in several steps leaves the files unchanged for the reference
+# implementation, which also sees the blocks moved away from as free
+check_defrag() {
+	img=$TMP/frag.fs
+
+	"$APPS"/fs_make.x "$img" 300 > /dev/null || fail "fs_make"
+	for i in 0 1 2 3 4 5 6 7; do
+		host_file "$TMP/d$i" 32
+	done
+	"$APPS"/test_fs.x add "$img" d0 d1 d2 d3 d4 d5 d6 d7 > /dev/null ||
+		fail "add"
+	for f in d1 d3 d5; do
+		"$APPS"/test_fs.x rm "$img" $f > /dev/null || fail "rm"
+	done
+	# Too large for the free run at the end, so it fills the holes
+	host_file "$TMP/d8" 120
+	"$APPS"/test_fs.x add "$img" d8 > /dev/null || fail "add"
+
+	"$APPS"/test_fs.x defrag "$img" 32 > "$TMP/out" || fail "defrag"
+	grep -q "^before: .*, [1-9][0-9]* fragmented," "$TMP/out" ||
+		fail "nothing to defragment"
+	grep -q "^after: .*, 0 fragmented, .* score 0.000$" "$TMP/out" ||
+		fail "files still fragmented: $(tail -n 1 "$TMP/out")"
+
+	# 280 blocks in use out of the 299 usable ones
+	"$APPS"/fs_ref.x info "$img" | grep -q "^fat_free_ratio=19/300$" ||
+		fail "blocks leaked by defrag"
+	for f in d0 d2 d4 d6 d7 d8; do
+		ref_cmp "$img" $f "$TMP/$f"
+	done
+}
+
+# Files whose name is not a valid host file name are not exported
+check_export_names() {
+	img=$TMP/export.fs
+
+	"$APPS"/fs_make.x "$img" 100 > /dev/null || fail "fs_make"
+	host_file "$TMP/good" 2
+	"$APPS"/test_fs.x add "$img" good > /dev/null || fail "add"
+	printf 'MOUNT\nCREATE\tsub/h4\nCREATE\t../x\nCREATE\t..\nUMOUNT\n' \
+		> "$TMP/names.script"
+	"$APPS"/test_fs.x script "$img" "$TMP/names.script" > /dev/null ||
+		fail "script"
+
+	mkdir "$TMP/dir"
+	"$APPS"/test_fs.x export "$img" "$TMP/dir/out" > /dev/null 2> "$TMP/err" &&
+		fail "export of invalid names succeeded"
+	for name in sub/h4 ../x ..; do
+		grep -qF "Not a valid host file name: $name" "$TMP/err" ||
+			fail "export did not reject $name"
+	done
+	[ -e "$TMP/dir/x" ] && fail "export wrote outside its directory"
+	cmp -s "$TMP/good" "$TMP/dir/out/good" || fail "good not exported"
+}
+
+# Files added from another directory take their own name
+check_add_names() {
+	img=$TMP/add.fs
+	long=name_over_16_chars
+
+	"$APPS"/fs_make.x "$img" 100 > /dev/null || fail "fs_make"
+	mkdir "$TMP/sub"
+	host_file "$TMP/sub/h4" 1
+	host_file "$TMP/sub/$long" 1
+	"$APPS"/test_fs.x add "$img" "$TMP/sub/h4" "$TMP/sub/$long" \
+		> /dev/null 2> "$TMP/err" && fail "add of a long name succeeded"
+	grep -qF "File name too long: $long" "$TMP/err" ||
+		fail "add did not reject $long"
+
+	"$APPS"/test_fs.x ls "$img" > "$TMP/ls" || fail "ls"
+	grep -q "^file: h4," "$TMP/ls" || fail "sub/h4 not added as h4"
+	[ "$(grep -c "^file: " "$TMP/ls")" -eq 1 ] || fail "unexpected files"
+
+	"$APPS"/test_fs.x export "$img" "$TMP/add.d" > /dev/null || fail "export"
+	cmp -s "$TMP/sub/h4" "$TMP/add.d/h4" || fail "h4 changed"
+}
+
+# Changes synced to the journal survive a crash before they reach their home
+# blocks, and are replayed at the next mount
+check_journal_replay() {
+	img=$TMP/journal.fs
+
+	"$APPS"/fs_make.x "$img" 200 > /dev/null || fail "fs_make"
+	host_file "$TMP/old" 40
+	"$APPS"/test_fs.x --journal add "$img" old > /dev/null || fail "add"
+	host_file "$TMP/new" 30
+	{
+		printf 'MOUNT\nDELETE\told\nCREATE\tnew\nOPEN\tnew\n'
+		printf 'WRITE\tFILE\tnew\nCLOSE\nSYNC\nCRASH\n'
+	} > "$TMP/crash.script"
+	"$APPS"/test_fs.x --journal script "$img" "$TMP/crash.script" \
+		> /dev/null || fail "script"
+
+	"$APPS"/test_fs.x ls "$img" > "$TMP/ls" || fail "ls"
+	grep -q "^file: new, size: 122880," "$TMP/ls" || fail "new not replayed"
+	[ "$(grep -c "^file: " "$TMP/ls")" -eq 1 ] || fail "old not deleted"
+	ref_cmp "$img" new "$TMP/new"
+	ref_info "$img"
+}
+
+# Files written and deleted with a lazily loaded FAT, spread over several FAT
+# blocks, read back the same after a full remount
+check_lazy_fat() {
+	img=$TMP/lazy.fs
+
+	# Three FAT blocks of 2048 entries
+	"$APPS"/fs_make.x "$img" 5000 > /dev/null || fail "fs_make"
+	host_file "$TMP/l0" 1500
+	host_file "$TMP/l1" 1500
+	"$APPS"/test_fs.x --lazy add "$img" l0 l1 > /dev/null || fail "add"
+	"$APPS"/test_fs.x --lazy rm "$img" l0 > /dev/null || fail "rm"
+	# Fills the hole left by l0, then goes past l1 into the last FAT block
+	host_file "$TMP/l2" 3000
+	"$APPS"/test_fs.x --lazy add "$img" l2 > /dev/null || fail "add"
+
+	ref_info "$img" --lazy
+	ref_info "$img"
+	for f in l1 l2; do
+		ref_cmp "$img" $f "$TMP/$f"
+	done
+}
+
+check_defrag_journal
+check_export_names
+check_add_names
+check_journal_replay
+check_lazy_fat
+check_defrag
+echo "check_fs: OK"
@@ -0,0 +1,368 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <trace.h>
+
+/*
+ * Trace replay
+ *
+ * Re-executes a trace recorded with fs_trace_start() (or test_fs.x --trace)
+ * against a freshly formatted disk image, either as fast as possible or
+ * following the original timing, then reports throughput and per-operation
+ * latency. The calls are replayed one after the other in the order they
+ * returned, file descriptors being mapped to the ones the replay gets. Data
+ * contents are not recorded, writes use a fixed pattern, and vectored calls are
+ * replayed with a single buffer.
+ */
+
+#define DATA_BLOCKS	8192
+#define MAX_FD		1024
+
+#define die(...)				\
+do {						\
+	fprintf(stderr, __VA_ARGS__);		\
+	fprintf(stderr, "\n");			\
+	exit(1);				\
+} while (0)
+
+static const char *op_names[FS_STATS_OP_COUNT] = {
+	"mount", "umount", "info", "create", "delete", "ls", "open", "close",
+	"stat", "lseek", "write", "read", "reserve", "flush", "sync",
+	"pwrite", "pread", "writev", "readv", "copy_out", "defrag"
+};
+
+struct call {
+	struct trace_rec rec;
+	char name[FS_FILENAME_LEN + 1];
+};
+
+/* Latencies of one operation, in nanoseconds */
+struct samples {
+	uint64_t *ns;
+	size_t count;
+	size_t cap;
+};
+
+static struct call *calls;
+static size_t ncalls;
+static size_t max_io;		/* Largest fs_read() or fs_write() */
+
+/* Reads and writes at the offset of their descriptor */
+static int moves_offset(int op)
+{
+	return op == FS_STATS_READ || op == FS_STATS_WRITE ||
+	       op == FS_STATS_READV || op == FS_STATS_WRITEV;
+}
+
+/* Calls that transfer data */
+static int transfers(int op)
+{
+	return moves_offset(op) || op == FS_STATS_PREAD ||
+	       op == FS_STATS_PWRITE || op == FS_STATS_COPY_OUT;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void load_trace(const char *path)
+{
+	struct trace_hdr hdr;
+	size_t cap = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		die("Cannot open %s", path);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC)
+		die("%s is not a trace", path);
+	if (hdr.version != TRACE_VERSION)
+		die("Unsupported trace version %u", hdr.version);
+
+	for (;;) {
+		struct call c;
+
+		memset(&c, 0, sizeof(c));
+		if (fread(&c.rec, sizeof(c.rec), 1, f) != 1)
+			break;
+		if (c.rec.op >= FS_STATS_OP_COUNT ||
+		    c.rec.name_len > FS_FILENAME_LEN ||
+		    fread(c.name, 1, c.rec.name_len, f) != c.rec.name_len)
+			die("Corrupted trace %s", path);
+
+		if (ncalls == cap) {
+			cap = cap ? cap * 2 : 1024;
+			calls = realloc(calls, cap * sizeof(*calls));
+			if (!calls)
+				die("Out of memory");
+		}
+		calls[ncalls++] = c;
+		if (transfers(c.rec.op) && c.rec.arg > max_io)
+			max_io = c.rec.arg;
+	}
+	fclose(f);
+}
+
+static void sample_add(struct samples *s, uint64_t ns)
+{
+	if (s->count == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 256;
+		s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+		if (!s->ns)
+			die("Out of memory");
+	}
+	s->ns[s->count++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(struct samples *s, double q)
+{
+	size_t i = q * s->count;
+
+	if (i >= s->count)
+		i = s->count - 1;
+	return s->ns[i] / 1e3;
+}
+
+/* Run fs_info() or fs_ls() without their output */
+static int quiet(int (*fn)(void))
+{
+	int saved, null, ret;
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	ret = fn();
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	close(null);
+	return ret;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [--timed] [--blocks <count>] [<mount option>...] <trace> <diskimage>\n",
+		program);
+	fprintf(stderr, "Possible options are:\n");
+	fprintf(stderr, "\t--timed\tstart each call at its recorded time instead of as fast as possible\n");
+	fprintf(stderr, "\t--blocks <count>\tdata blocks of the formatted image (default %d)\n",
+		DATA_BLOCKS);
+	fprintf(stderr, "\t--mmap, --uring, --journal, --lazy\tmount flags, see test_fs.x\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct samples lat[FS_STATS_OP_COUNT];
+	static int fds[MAX_FD];		/* Traced fd to replay fd, plus 1 */
+	static size_t offsets[MAX_FD];	/* Offset of each replay fd */
+	char *buf;
+	char *program = argv[0];
+	size_t data_blocks = DATA_BLOCKS;
+	int timed = 0, mount_flags = 0;
+	size_t mismatches = 0, skipped = 0, bytes = 0;
+	uint64_t start, elapsed;
+	char *trace, *diskname;
+
+	for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+		if (!strcmp(argv[0], "--timed")) {
+			timed = 1;
+		} else if (!strcmp(argv[0], "--blocks") && argc > 1) {
+			data_blocks = strtoul(*++argv, NULL, 0);
+			argc--;
+		} else if (!strcmp(argv[0], "--mmap")) {
+			mount_flags |= FS_MOUNT_MMAP;
+		} else if (!strcmp(argv[0], "--uring")) {
+			mount_flags |= FS_MOUNT_URING;
+		} else if (!strcmp(argv[0], "--journal")) {
+			mount_flags |= FS_MOUNT_JOURNAL;
+		} else if (!strcmp(argv[0], "--lazy")) {
+			mount_flags |= FS_MOUNT_LAZY;
+		} else {
+			usage(program);
+		}
+	}
+	if (argc != 2)
+		usage(program);
+	trace = argv[0];
+	diskname = argv[1];
+
+	load_trace(trace);
+	if (fs_format(diskname, data_blocks))
+		die("Cannot format %s", diskname);
+	buf = malloc(max_io ? max_io : 1);
+	if (!buf)
+		die("Out of memory");
+	memset(buf, 0xA5, max_io);
+
+	/* The trace may have been started on a mounted file system */
+	if (ncalls && calls[0].rec.op != FS_STATS_MOUNT &&
+	    fs_mount_flags(diskname, mount_flags))
+		die("Cannot mount %s", diskname);
+
+	start = now_ns();
+	for (size_t i = 0; i < ncalls; i++) {
+		struct trace_rec *r = &calls[i].rec;
+		char *name = calls[i].name;
+		struct iovec iov = { buf, r->arg };
+		int fd = -1, ret = -1;
+		uint64_t t;
+
+		if (r->fd >= 0) {
+			if (r->fd >= MAX_FD || fds[r->fd] == 0) {
+				skipped++;
+				continue;
+			}
+			fd = fds[r->fd] - 1;
+		}
+
+		/* Reads and writes start where the traced ones did */
+		if (moves_offset(r->op) && fd >= 0 && offsets[fd] != r->offset) {
+			if (fs_lseek(fd, r->offset) == 0)
+				offsets[fd] = r->offset;
+		}
+
+		if (timed) {
+			uint64_t when = start + r->start_ns;
+			struct timespec ts;
+
+			t = now_ns();
+			if (when > t) {
+				ts.tv_sec = (when - t) / 1000000000;
+				ts.tv_nsec = (when - t) % 1000000000;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		t = now_ns();
+		switch (r->op) {
+		case FS_STATS_MOUNT:
+			ret = fs_mount_flags(diskname, r->arg | mount_flags);
+			break;
+		case FS_STATS_UMOUNT:
+			ret = fs_umount();
+			break;
+		case FS_STATS_INFO:
+			ret = quiet(fs_info);
+			break;
+		case FS_STATS_LS:
+			ret = quiet(fs_ls);
+			break;
+		case FS_STATS_CREATE:
+			ret = fs_create(name);
+			break;
+		case FS_STATS_DELETE:
+			ret = fs_delete(name);
+			break;
+		case FS_STATS_OPEN:
+			ret = fs_open(name);
+			break;
+		case FS_STATS_CLOSE:
+			ret = fs_close(fd);
+			break;
+		case FS_STATS_STAT:
+			ret = fs_stat(fd);
+			break;
+		case FS_STATS_LSEEK:
+			ret = fs_lseek(fd, r->arg);
+			break;
+		case FS_STATS_WRITE:
+			ret = fs_write(fd, buf, r->arg);
+			break;
+		case FS_STATS_READ:
+			ret = fs_read(fd, buf, r->arg);
+			break;
+		case FS_STATS_RESERVE:
+			ret = fs_reserve(fd, r->arg);
+			break;
+		case FS_STATS_FLUSH:
+			ret = fs_flush();
+			break;
+		case FS_STATS_SYNC:
+			ret = fs_sync();
+			break;
+		case FS_STATS_PWRITE:
+			ret = fs_pwrite(fd, buf, r->arg, r->offset);
+			break;
+		case FS_STATS_PREAD:
+			ret = fs_pread(fd, buf, r->arg, r->offset);
+			break;
+		case FS_STATS_WRITEV:
+			ret = fs_writev(fd, &iov, 1);
+			break;
+		case FS_STATS_READV:
+			ret = fs_readv(fd, &iov, 1);
+			break;
+		case FS_STATS_COPY_OUT:
+			/* The host file is gone, read the same data */
+			ret = fs_pread(fd, buf, r->arg, r->offset);
+			break;
+		case FS_STATS_DEFRAG:
+			ret = fs_defrag(r->arg);
+			break;
+		}
+		sample_add(&lat[r->op], now_ns() - t);
+
+		/* Keep the descriptor and offset bookkeeping in step */
+		if (r->op == FS_STATS_OPEN && r->ret >= 0 && r->ret < MAX_FD &&
+		    ret >= 0) {
+			fds[r->ret] = ret + 1;
+			offsets[ret] = 0;
+		} else if (r->op == FS_STATS_CLOSE && ret == 0) {
+			fds[r->fd] = 0;
+		} else if (r->op == FS_STATS_LSEEK && ret == 0) {
+			offsets[fd] = r->arg;
+		} else if (transfers(r->op) && ret > 0) {
+			if (moves_offset(r->op))
+				offsets[fd] += ret;
+			bytes += ret;
+		}
+		if ((ret < 0) != (r->ret < 0) ||
+		    ((transfers(r->op) || r->op == FS_STATS_STAT) &&
+		     ret != r->ret))
+			mismatches++;
+	}
+	elapsed = now_ns() - start;
+
+	printf("replayed %zu calls in %.3fs: %.0f ops/s, %.1f MB/s\n",
+	       ncalls - skipped, elapsed / 1e9,
+	       (ncalls - skipped) / (elapsed / 1e9),
+	       bytes / (elapsed / 1e9) / (1 << 20));
+	printf("%zu results differ from the trace, %zu calls skipped\n",
+	       mismatches, skipped);
+	printf("%-8s %8s %10s %10s %10s\n", "op", "calls", "p50(us)",
+	       "p99(us)", "p999(us)");
+	for (int op = 0; op < FS_STATS_OP_COUNT; op++) {
+		struct samples *s = &lat[op];
+
+		if (s->count == 0)
+			continue;
+		qsort(s->ns, s->count, sizeof(*s->ns), cmp_u64);
+		printf("%-8s %8zu %10.1f %10.1f %10.1f\n", op_names[op],
+		       s->count, percentile(s, 0.50), percentile(s, 0.99),
+		       percentile(s, 0.999));
+		free(s->ns);
+	}
+
+	free(buf);
+	free(calls);
+	return 0;
+}
@@ -0,0 +1,295 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/*
+ * Multi-threaded stress and scaling test
+ *
+ * Every file is made of chunks of CHUNK bytes whose content is fully
+ * determined by the generation stored in their header, so that a reader can
+ * tell whether it observed a torn write.
+ */
+
+#define CHUNK		4096
+#define FILE_CHUNKS	128
+#define FILE_BYTES	(CHUNK * FILE_CHUNKS)
+#define READ_ROUNDS	4
+#define STRESS_OPS	2000
+#define MAX_THREADS	16
+
+#define die(...)				\
+do {						\
+	fprintf(stderr, __VA_ARGS__);		\
+	fprintf(stderr, "\n");			\
+	exit(1);				\
+} while (0)
+
+struct chunk_hdr {
+	uint32_t gen;
+	uint32_t file;
+	uint32_t idx;
+};
+
+static int nfiles;
+
+static void file_name(char *name, const char *prefix, unsigned char file)
+{
+	snprintf(name, FS_FILENAME_LEN, "%s.%hhu", prefix, file);
+}
+
+static void chunk_fill(char *buf, uint32_t gen, uint32_t file, uint32_t idx)
+{
+	struct chunk_hdr hdr = { gen, file, idx };
+
+	memcpy(buf, &hdr, sizeof(hdr));
+	for (size_t i = sizeof(hdr); i < CHUNK; i++)
+		buf[i] = (gen * 7 + file * 13 + idx + i) & 0xFF;
+}
+
+static int chunk_check(const char *buf, uint32_t file, uint32_t idx)
+{
+	struct chunk_hdr hdr;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.file != file || hdr.idx != idx)
+		return -1;
+	for (size_t i = sizeof(hdr); i < CHUNK; i++)
+		if ((char)((hdr.gen * 7 + file * 13 + idx + i) & 0xFF) != buf[i])
+			return -1;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read a whole file sequentially and check every chunk */
+static void read_file(int file)
+{
+	char name[FS_FILENAME_LEN];
+	static __thread char buf[CHUNK * 16];
+	int fd;
+
+	file_name(name, "stress", file);
+	fd = fs_open(name);
+	if (fd < 0)
+		die("Cannot open %s", name);
+
+	for (int c = 0; c < FILE_CHUNKS; c += 16) {
+		if (fs_read(fd, buf, sizeof(buf)) != sizeof(buf))
+			die("Short read of %s", name);
+		for (int i = 0; i < 16; i++)
+			if (chunk_check(buf + i * CHUNK, file, c + i))
+				die("Corrupted chunk %d of %s", c + i, name);
+	}
+
+	fs_close(fd);
+}
+
+struct worker {
+	pthread_t tid;
+	int id;
+	int same_file;
+	unsigned int seed;
+	size_t ops;
+};
+
+static void *scaling_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	for (int r = 0; r < READ_ROUNDS; r++)
+		read_file(w->same_file ? 0 : w->id);
+	return NULL;
+}
+
+/* Random mix of checked reads, chunk rewrites, stats and syncs */
+static void *stress_worker(void *arg)
+{
+	struct worker *w = arg;
+	char name[FS_FILENAME_LEN];
+	char buf[CHUNK];
+
+	for (int n = 0; n < STRESS_OPS; n++) {
+		int op = rand_r(&w->seed) % 16;
+		int file = rand_r(&w->seed) % nfiles;
+		int idx = rand_r(&w->seed) % FILE_CHUNKS;
+		int fd;
+
+		file_name(name, "stress", file);
+		fd = fs_open(name);
+		if (fd < 0)
+			die("Cannot open %s", name);
+
+		if (op < 8) {
+			if (fs_lseek(fd, (size_t)idx * CHUNK) ||
+			    fs_read(fd, buf, CHUNK) != CHUNK)
+				die("Cannot read chunk %d of %s", idx, name);
+			if (chunk_check(buf, file, idx))
+				die("Torn chunk %d of %s", idx, name);
+		} else if (op < 14) {
+			chunk_fill(buf, rand_r(&w->seed), file, idx);
+			if (fs_lseek(fd, (size_t)idx * CHUNK) ||
+			    fs_write(fd, buf, CHUNK) != CHUNK)
+				die("Cannot write chunk %d of %s", idx, name);
+		} else if (op < 15) {
+			if (fs_stat(fd) != FILE_BYTES)
+				die("Wrong size for %s", name);
+		} else {
+			if (fs_sync())
+				die("Cannot sync");
+		}
+
+		fs_close(fd);
+		w->ops++;
+	}
+	return NULL;
+}
+
+/* Create and delete a private file in a loop while the others run */
+static void *churn_worker(void *arg)
+{
+	struct worker *w = arg;
+	char name[FS_FILENAME_LEN];
+	char buf[CHUNK];
+	int fd;
+
+	file_name(name, "churn", w->id);
+	for (int n = 0; n < STRESS_OPS / 10; n++) {
+		if (fs_create(name))
+			die("Cannot create %s", name);
+		fd = fs_open(name);
+		if (fd < 0)
+			die("Cannot open %s", name);
+		for (int i = 0; i < 4; i++) {
+			chunk_fill(buf, n, nfiles, i);
+			if (fs_write(fd, buf, CHUNK) != CHUNK)
+				die("Cannot write %s", name);
+		}
+		fs_lseek(fd, 0);
+		for (int i = 0; i < 4; i++)
+			if (fs_read(fd, buf, CHUNK) != CHUNK ||
+			    chunk_check(buf, nfiles, i))
+				die("Corrupted %s", name);
+		fs_close(fd);
+		if (fs_delete(name))
+			die("Cannot delete %s", name);
+		w->ops++;
+	}
+	return NULL;
+}
+
+static double run(struct worker *w, int nthreads, void *(*fn)(void *))
+{
+	double start = now();
+
+	for (int i = 0; i < nthreads; i++)
+		if (pthread_create(&w[i].tid, NULL, fn, &w[i]))
+			die("Cannot create thread");
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(w[i].tid, NULL);
+
+	return now() - start;
+}
+
+static void setup(void)
+{
+	char name[FS_FILENAME_LEN];
+	char buf[CHUNK];
+	int fd;
+
+	for (int f = 0; f < nfiles; f++) {
+		file_name(name, "stress", f);
+		fs_delete(name);
+		if (fs_create(name))
+			die("Cannot create %s", name);
+		fd = fs_open(name);
+		if (fd < 0)
+			die("Cannot open %s", name);
+		if (fs_reserve(fd, FILE_BYTES))
+			die("Not enough space for %s", name);
+		for (int c = 0; c < FILE_CHUNKS; c++) {
+			chunk_fill(buf, 0, f, c);
+			if (fs_write(fd, buf, CHUNK) != CHUNK)
+				die("Cannot write %s", name);
+		}
+		fs_close(fd);
+	}
+	if (fs_sync())
+		die("Cannot sync");
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker w[MAX_THREADS + 1];
+	char *diskname;
+	int max_threads = 8;
+	double secs, mb;
+	size_t ops;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskimage> [max threads]\n", argv[0]);
+		exit(1);
+	}
+	diskname = argv[1];
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (max_threads < 1 || max_threads > MAX_THREADS)
+		die("Thread count must be between 1 and %d", MAX_THREADS);
+	nfiles = max_threads;
+
+	if (fs_mount(diskname))
+		die("Cannot mount %s", diskname);
+	setup();
+
+	/* Scaling of concurrent readers, on different files then on one file */
+	printf("threads\tdistinct MB/s\tshared MB/s\n");
+	for (int t = 1; t <= max_threads; t *= 2) {
+		mb = (double)t * READ_ROUNDS * FILE_BYTES / (1 << 20);
+		memset(w, 0, sizeof(w));
+		for (int i = 0; i < t; i++)
+			w[i].id = i;
+		printf("%d\t%.1f", t, mb / run(w, t, scaling_worker));
+		for (int i = 0; i < t; i++)
+			w[i].same_file = 1;
+		printf("\t%.1f\n", mb / run(w, t, scaling_worker));
+	}
+
+	/* Mixed stress, plus one thread creating and deleting files */
+	memset(w, 0, sizeof(w));
+	for (int i = 0; i <= max_threads; i++) {
+		w[i].id = i;
+		w[i].seed = i + 1;
+	}
+	secs = run(w, max_threads, stress_worker);
+	pthread_create(&w[max_threads].tid, NULL, churn_worker, &w[max_threads]);
+	secs += run(w, max_threads, stress_worker);
+	pthread_join(w[max_threads].tid, NULL);
+	ops = 0;
+	for (int i = 0; i <= max_threads; i++)
+		ops += w[i].ops;
+	printf("stress: %zu ops in %.2fs (%.0f ops/s)\n", ops, secs, ops / secs);
+
+	/* Whatever the interleaving, every chunk must have survived intact */
+	if (fs_umount())
+		die("Cannot unmount %s", diskname);
+	if (fs_mount(diskname))
+		die("Cannot remount %s", diskname);
+	for (int f = 0; f < nfiles; f++)
+		read_file(f);
+	if (fs_umount())
+		die("Cannot unmount %s", diskname);
+
+	printf("stress: OK\n");
+	return 0;
+}
@@ -1,12 +1,18 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -34,6 +40,136 @@ struct thread_arg {
 	char **argv;
 };
 
+/*
+ * Flags passed to fs_mount_flags(), set from the command line options.
+ * Commands that only look at a few files always load the FAT lazily.
+ */
+static int mount_flags;
+
+/* Maximum nesting of LOOP commands in a script */
+#define SCRIPT_LOOP_DEPTH 8
+
+/* File descriptor opened by a script, OPEN can give it a name */
+struct script_fd {
+	char name[32];
+	int fd;				/* -1 if the slot is free */
+};
+
+/* LOOP being executed by a script */
+struct script_loop {
+	size_t start;			/* Line of the LOOP command */
+	size_t count;			/* Number of iterations */
+	size_t index;			/* Current iteration, from 0 */
+};
+
+/* State of the generator behind SEED, ranges and WRITE RANDOM */
+static uint64_t script_rng;
+
+/* splitmix64, any seed gives a good sequence */
+static uint64_t script_random(void)
+{
+	uint64_t z = (script_rng += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* Parse "<n>[K|M|G]" at *s and move *s past it */
+static size_t script_size(char **s)
+{
+	char *end;
+	size_t n;
+
+	n = strtoull(*s, &end, 10);
+	if (end == *s)
+		die("invalid number '%s'", *s);
+	switch (*end) {
+	case 'K':
+		n <<= 10;
+		end++;
+		break;
+	case 'M':
+		n <<= 20;
+		end++;
+		break;
+	case 'G':
+		n <<= 30;
+		end++;
+		break;
+	}
+	*s = end;
+	return n;
+}
+
+/*
+ * Value of a numeric argument, either "<n>" or "<lo>..<hi>[/<align>]" for a
+ * random value between lo and hi included, rounded down to a multiple of align
+ */
+static size_t script_number(char *arg)
+{
+	size_t lo, hi, align = 1, n;
+	char *s = arg;
+
+	if (!arg)
+		die("missing number");
+	lo = script_size(&s);
+	if (strncmp(s, "..", 2)) {
+		if (*s)
+			die("invalid number '%s'", arg);
+		return lo;
+	}
+	s += 2;
+	hi = script_size(&s);
+	if (*s == '/') {
+		s++;
+		align = script_size(&s);
+	}
+	if (*s || hi < lo || !align)
+		die("invalid range '%s'", arg);
+
+	n = lo + script_random() % (hi - lo + 1);
+	return n - n % align;
+}
+
+/* Copy file name @arg to @buf, replacing each "$i" by @index */
+static char *script_name(char *arg, size_t index, char *buf, size_t len)
+{
+	size_t n = 0;
+
+	if (!arg)
+		die("missing file name");
+	while (*arg && n < len - 1) {
+		if (arg[0] == '$' && arg[1] == 'i') {
+			n += snprintf(buf + n, len - n, "%zu", index);
+			arg += 2;
+		} else {
+			buf[n++] = *arg++;
+		}
+	}
+	if (n > len - 1)
+		n = len - 1;
+	buf[n] = '\0';
+	return buf;
+}
+
+/* Tell whether script line @line holds command @cmd */
+static int script_is(const char *line, const char *cmd)
+{
+	size_t n = strlen(cmd);
+
+	return !strncmp(line, cmd, n) && strchr("\t\r\n", line[n]);
+}
+
+/* Open descriptor named @name, NULL if none */
+static struct script_fd *script_fd(struct script_fd *fds, const char *name)
+{
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		if (fds[i].fd >= 0 && !strcmp(fds[i].name, name))
+			return &fds[i];
+	return NULL;
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -43,12 +179,26 @@ void thread_fs_script(void *arg)
 	char *command, *data_source, *data_description, *data, *fs_filename;
 	const int total_command_parts = 4;
 	char *command_args[total_command_parts];
-	int offset;
+	size_t offset;
 	char mounted = 0;
 
 	char line_buffer[1024];
 	int command_index = 1;
 
+	char **lines = NULL;
+	size_t line_count = 0, pc;
+	struct script_loop loops[SCRIPT_LOOP_DEPTH];
+	int depth = 0;
+	struct script_fd fds[FS_OPEN_MAX_COUNT], *cur = NULL;
+	char name_buf[64];
+	char *io_buf = NULL;
+	size_t io_size = 0;
+
+	/* Counted since TIMER START */
+	struct timespec timer_start;
+	char timer_label[64] = "";
+	size_t ops = 0, bytes_read = 0, bytes_written = 0;
+
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <script filename>");
 
@@ -60,10 +210,25 @@ void thread_fs_script(void *arg)
 	if (!fd_script)
 		die_perror("fopen");
 
-	int fs_fd = -1;
+	/* Load the whole script, loops jump back to earlier lines */
+	while (fgets(line_buffer, sizeof(line_buffer), fd_script) != NULL) {
+		lines = realloc(lines, (line_count + 1) * sizeof(*lines));
+		if (!lines)
+			die_perror("realloc");
+		lines[line_count] = strdup(line_buffer);
+		if (!lines[line_count++])
+			die_perror("strdup");
+	}
+	fclose(fd_script);
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		fds[i].fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &timer_start);
 
 	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
+	for (pc = 0; pc < line_count; pc++) {
+		strcpy(line_buffer, lines[pc]);
+
 		/* Remove trailing newline from command line */
 		char *nl = strchr(line_buffer, '\n');
 		if (nl)
@@ -79,18 +244,22 @@ void thread_fs_script(void *arg)
 
 		int data_fd;
 		int count, data_size;
+		int fs_fd = cur ? cur->fd : -1;
+		size_t index = depth ? loops[depth - 1].index : 0;
+		int control = 0;
 
 		char *read_buf;
 
-		/* End when no command present */
-		if (!command)
-			break;
+		/* Skip empty lines and comments */
+		if (!command || command[0] == '#')
+			continue;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			if (fs_mount_flags(diskname, mount_flags))
 				die("Cannot mount disk");
 			else {
-				printf("MOUNT successful.\n");
+				if (!depth)
+					printf("MOUNT successful.\n");
 				mounted = 1;
 			}
 
@@ -98,65 +267,115 @@ void thread_fs_script(void *arg)
 			if (mounted && fs_umount())
 				die("Cannot unmount");
 			else {
-				printf("UMOUNT successful.\n");
+				if (!depth)
+					printf("UMOUNT successful.\n");
 				mounted = 0;
 			}
 
 		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+			fs_filename = script_name(command_args[1], index,
+						  name_buf, sizeof(name_buf));
 
 			if(fs_create(fs_filename)) {
 				fs_umount();
-				die("Cannot create file");
+				die("Cannot create file %s", fs_filename);
 			}
 
-			printf("CREATE successful.\n");
+			if (!depth)
+				printf("CREATE successful.\n");
 
 		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
+			fs_filename = script_name(command_args[1], index,
+						  name_buf, sizeof(name_buf));
 
 			if(fs_delete(fs_filename)) {
 				fs_umount();
-				die("Cannot delete file");
+				die("Cannot delete file %s", fs_filename);
 			}
 
-			printf("DELETE successful.\n");
+			if (!depth)
+				printf("DELETE successful.\n");
 
 		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+			const char *fd_name = command_args[2] ? command_args[2] : "";
+			struct script_fd *slot;
+
+			fs_filename = script_name(command_args[1], index,
+						  name_buf, sizeof(name_buf));
 
-			fs_fd = fs_open(fs_filename);
+			if (script_fd(fds, fd_name))
+				die("Descriptor '%s' is already open", fd_name);
+			for (slot = fds; slot < fds + FS_OPEN_MAX_COUNT; slot++)
+				if (slot->fd < 0)
+					break;
+			if (slot == fds + FS_OPEN_MAX_COUNT)
+				die("Too many open files");
 
-			if (fs_fd < 0) {
+			slot->fd = fs_open(fs_filename);
+
+			if (slot->fd < 0) {
 				fs_umount();
-				die("Cannot open file");
+				die("Cannot open file %s", fs_filename);
 			}
+			snprintf(slot->name, sizeof(slot->name), "%s", fd_name);
+			cur = slot;
 
-			printf("OPEN successful.\n");
+			if (!depth)
+				printf("OPEN successful.\n");
 
 		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
+			struct script_fd *slot = cur;
+
+			if (command_args[1])
+				slot = script_fd(fds, command_args[1]);
+			if (!slot)
+				die("No such descriptor");
+
+			if (fs_close(slot->fd)) {
 				fs_umount();
 				die("Cannot close file");
 			}
+			slot->fd = -1;
+			if (slot == cur)
+				cur = NULL;
 
-			printf("CLOSE successful.\n");
+			if (!depth)
+				printf("CLOSE successful.\n");
+
+		} else if (strcmp(command, "SYNC") == 0) {
+			if (fs_sync()) {
+				fs_umount();
+				die("Cannot sync");
+			}
+
+			if (!depth)
+				printf("SYNC successful.\n");
+
+		} else if (strcmp(command, "USE") == 0) {
+			cur = script_fd(fds, command_args[1] ? command_args[1] : "");
+			if (!cur)
+				die("No such descriptor");
+			control = 1;
 
 		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+			offset = script_number(command_args[1]);
 
 			if (fs_lseek(fs_fd, offset)) {
 				fs_umount();
 				die("Cannot seek to position");
 			} else {
-				printf("SEEK successful.\n");
+				if (!depth)
+					printf("SEEK successful.\n");
 			}
 
 		} else if (strcmp(command, "WRITE") == 0) {
 			data_source = command_args[1];
 			data_description = command_args[2];
 
-			if (strcmp(data_source, "DATA") == 0) {
+			if (!data_source) {
+				data = NULL;
+				data_size = 0;
+			} else if (strcmp(data_source, "DATA") == 0) {
 				data = data_description;
 				data_size = strlen(data);
 			} else if (strcmp(data_source, "FILE") == 0) {
@@ -175,6 +394,21 @@ void thread_fs_script(void *arg)
 				}
 				data_size = st.st_size;
 				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+			} else if (strcmp(data_source, "RANDOM") == 0) {
+				data_size = script_number(data_description);
+				if ((size_t)data_size > io_size) {
+					io_size = data_size;
+					io_buf = realloc(io_buf, io_size);
+					if (!io_buf)
+						die_perror("realloc");
+				}
+				for (int i = 0; i < data_size; i += sizeof(uint64_t)) {
+					uint64_t r = script_random();
+					int n = data_size - i;
+
+					memcpy(io_buf + i, &r, n < 8 ? n : 8);
+				}
+				data = io_buf;
 			} else {
 				data = NULL;
 				data_size = 0;
@@ -190,16 +424,22 @@ void thread_fs_script(void *arg)
 				fs_umount();
 				die("write error");
 			}
-			printf("Wrote %d bytes to file.\n", count);
+			bytes_written += count;
+			if (!depth)
+				printf("Wrote %d bytes to file.\n", count);
 
 		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
+			int read_req_length = script_number(command_args[1]);
 			data_source = command_args[2];
 			data_description = command_args[3];
 
 			char file_loaded = 0;
 
-			if (strcmp(data_source, "DATA") == 0) {
+			if (!data_source) {
+				/* Read only, nothing to compare */
+				data = NULL;
+				data_size = 0;
+			} else if (strcmp(data_source, "DATA") == 0) {
 				data = data_description;
 				data_size = strlen(data);
 			} else if (strcmp(data_source, "FILE") == 0) {
@@ -229,7 +469,7 @@ void thread_fs_script(void *arg)
 				die("Invalid data description");
 			}
 
-			if (!data) {
+			if (data_source && !data) {
 				fs_umount();
 				die_perror("Could not find data to write");
 			}
@@ -239,34 +479,137 @@ void thread_fs_script(void *arg)
 				die("invalid data read length");
 			}
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+			if (!data_source) {
+				if ((size_t)read_req_length > io_size) {
+					io_size = read_req_length;
+					io_buf = realloc(io_buf, io_size);
+					if (!io_buf)
+						die_perror("realloc");
+				}
+				count = fs_read(fs_fd, io_buf, read_req_length);
+				if (count < 0) {
+					fs_umount();
+					die("read error");
+				}
+				bytes_read += count;
+				if (!depth)
+					printf("Read %d bytes from file.\n", count);
+			} else {
+				read_buf = calloc(read_req_length+1, sizeof(char));
+				count = fs_read(fs_fd, read_buf, read_req_length);
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
+				if (count < 0) {
+					fs_umount();
+					die("read error");
+				}
+				bytes_read += count;
+
+				// both data and read_buf were allocated with an extra zero byte
+				// +1 here to check for the canaries
+				if (memcmp(data, read_buf, data_size+1) == 0) {
+					if (!depth)
+						printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
+				} else
+					printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+
+				free(read_buf);
+				if(file_loaded){
+					free(data);
+				}
 			}
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+		} else if (strcmp(command, "LOOP") == 0) {
+			size_t iterations = script_number(command_args[1]);
+
+			control = 1;
+			if (iterations == 0) {
+				/* Jump to the matching END */
+				int nested = 1;
 
-			free(read_buf);
-			if(file_loaded){
-				free(data);
+				while (nested && ++pc < line_count) {
+					if (script_is(lines[pc], "LOOP"))
+						nested++;
+					else if (script_is(lines[pc], "END"))
+						nested--;
+				}
+				if (nested)
+					die("LOOP without END");
+				continue;
 			}
+			if (depth == SCRIPT_LOOP_DEPTH)
+				die("LOOP nested too deep");
+			loops[depth].start = pc;
+			loops[depth].count = iterations;
+			loops[depth].index = 0;
+			depth++;
+
+		} else if (strcmp(command, "END") == 0) {
+			struct script_loop *loop;
+
+			if (!depth)
+				die("END without LOOP");
+			loop = &loops[depth - 1];
+			control = 1;
+			if (++loop->index < loop->count)
+				pc = loop->start;
+			else
+				depth--;
+
+		} else if (strcmp(command, "SEED") == 0) {
+			if (!command_args[1])
+				die("missing seed");
+			script_rng = strtoull(command_args[1], NULL, 0);
+			control = 1;
+
+		} else if (strcmp(command, "TIMER") == 0) {
+			struct timespec now;
+			double elapsed;
+
+			control = 1;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (command_args[1] && strcmp(command_args[1], "START") == 0) {
+				snprintf(timer_label, sizeof(timer_label), "%s",
+					 command_args[2] ? command_args[2] : "");
+				timer_start = now;
+				ops = bytes_read = bytes_written = 0;
+			} else if (command_args[1] && strcmp(command_args[1], "STOP") == 0) {
+				elapsed = (now.tv_sec - timer_start.tv_sec) +
+					(now.tv_nsec - timer_start.tv_nsec) / 1e9;
+				printf("TIMER %s: %.6f s, %zu ops, %.0f ops/s, "
+				       "%zu bytes read, %zu bytes written, %.2f MB/s\n",
+				       timer_label, elapsed, ops, ops / elapsed,
+				       bytes_read, bytes_written,
+				       (bytes_read + bytes_written) / elapsed / (1 << 20));
+			} else {
+				die("Usage: TIMER START [<label>] | TIMER STOP");
+			}
+
+		} else if (strcmp(command, "CRASH") == 0) {
+			/* Stop dead like on a power cut: nothing is flushed nor
+			 * unmounted, for journal recovery tests */
+			fflush(stdout);
+			_exit(0);
+
+		} else {
+			die("Unknown command '%s'", command);
 		}
+
+		if (!control)
+			ops++;
 	}
 
+	if (depth)
+		die("LOOP without END");
+
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
 	if (mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	for (pc = 0; pc < line_count; pc++)
+		free(lines[pc]);
+	free(lines);
+	free(io_buf);
 }
 
 void thread_fs_stat(void *arg)
@@ -282,7 +625,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_flags(diskname, mount_flags | FS_MOUNT_LAZY))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -329,7 +672,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_flags(diskname, mount_flags | FS_MOUNT_LAZY))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -384,7 +727,7 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_mount_flags(diskname, mount_flags))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
@@ -398,67 +741,348 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+/* Largest number of threads copying files for the add and export commands */
+#define POOL_MAX_WORKERS 8
+
+/* Number of threads to process @jobs files with, one per CPU */
+static long pool_size(size_t jobs)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		n = 1;
+	if (n > POOL_MAX_WORKERS)
+		n = POOL_MAX_WORKERS;
+	if ((size_t)n > jobs)
+		n = jobs;
+	return n;
+}
+
+/* Host file imported by the add command */
+struct add_job {
+	char *path;			/* On the host */
+	char *name;			/* In the file system */
+	size_t size;
+	int written;			/* Bytes written, -1 on error */
+	const char *error;
+};
+
+/* Files of the add command, shared by the workers */
+struct add_batch {
+	struct add_job *jobs;
+	size_t count;
+	size_t next;			/* Next job to take */
+};
+
+/* Queue host file @path, to be named @name in the file system */
+static void add_queue(struct add_batch *b, const char *path, const char *name)
+{
+	struct stat st;
+	struct add_job *job;
+
+	if (stat(path, &st))
+		die_perror("stat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", path);
+
+	b->jobs = realloc(b->jobs, (b->count + 1) * sizeof(*b->jobs));
+	if (!b->jobs)
+		die_perror("realloc");
+	job = &b->jobs[b->count++];
+	job->path = strdup(path);
+	job->name = strdup(name);
+	if (!job->path || !job->name)
+		die_perror("strdup");
+	job->size = st.st_size;
+	job->written = -1;
+	job->error = NULL;
+	if (strlen(name) >= FS_FILENAME_LEN)
+		job->error = "File name too long";
+}
+
+static int cmp_job(const void *a, const void *b)
+{
+	return strcmp(((const struct add_job *)a)->name,
+		      ((const struct add_job *)b)->name);
+}
+
+/* Queue the regular files of host directory @dir, under their own name */
+static void add_queue_dir(struct add_batch *b, const char *dir)
+{
+	size_t first = b->count;
+	struct dirent *ent;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		die_perror("opendir");
+	while ((ent = readdir(d)) != NULL) {
+		char path[PATH_MAX];
+		struct stat st;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (stat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+		add_queue(b, path, ent->d_name);
+	}
+	closedir(d);
+
+	qsort(b->jobs + first, b->count - first, sizeof(*b->jobs), cmp_job);
+}
+
+/* Copy one host file into its file, whose blocks are already reserved */
+static void add_copy(struct add_job *job)
+{
+	char *buf = NULL;
+	int fd, fs_fd;
+
+	fd = open(job->path, O_RDONLY);
+	if (fd < 0) {
+		job->error = "Cannot open host file";
+		return;
+	}
+	if (job->size) {
+		buf = mmap(NULL, job->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			job->error = "Cannot map host file";
+			close(fd);
+			return;
+		}
+		/* Start reading the whole file ahead of the copy */
+		madvise(buf, job->size, MADV_SEQUENTIAL);
+		madvise(buf, job->size, MADV_WILLNEED);
+	}
+
+	fs_fd = fs_open(job->name);
+	if (fs_fd < 0) {
+		job->error = "Cannot open file";
+	} else {
+		job->written = job->size ? fs_write(fs_fd, buf, job->size) : 0;
+		if (job->written < 0)
+			job->error = "Cannot write file";
+		if (fs_close(fs_fd) && !job->error)
+			job->error = "Cannot close file";
+	}
+
+	if (job->size)
+		munmap(buf, job->size);
+	close(fd);
+}
+
+static void *add_worker(void *arg)
+{
+	struct add_batch *b = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count)
+		if (!b->jobs[i].error)
+			add_copy(&b->jobs[i]);
+	return NULL;
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fd, fs_fd;
-	struct stat st;
-	int written;
+	struct add_batch batch = { NULL, 0, 0 };
+	pthread_t workers[POOL_MAX_WORKERS];
+	char *diskname;
+	long nworkers;
+	int failed = 0;
+	size_t i;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("Usage: <diskname> <host file or directory>...");
 
 	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
 
-	/* Open file on host computer */
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		die_perror("open");
-	if (fstat(fd, &st))
-		die_perror("fstat");
-	if (!S_ISREG(st.st_mode))
-		die("Not a regular file: %s\n", filename);
-
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
+	/* Files keep their own name, without the directories leading to it */
+	for (i = 1; i < (size_t)t_arg->argc; i++) {
+		const char *name = strrchr(t_arg->argv[i], '/');
+		struct stat st;
+
+		if (stat(t_arg->argv[i], &st))
+			die_perror("stat");
+		if (S_ISDIR(st.st_mode))
+			add_queue_dir(&batch, t_arg->argv[i]);
+		else
+			add_queue(&batch, t_arg->argv[i],
+				  name ? name + 1 : t_arg->argv[i]);
+	}
 
 	/* Now, deal with our filesystem:
-	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
+	 * - mount once, create every file and reserve its blocks one file after
+	 *   the other, so that each gets a contiguous run
+	 * - copy the contents of the host files from a pool of threads, the
+	 *   writes fill the reserved blocks
+	 * - umount once
 	 */
-	if (fs_mount(diskname))
+	if (fs_mount_flags(diskname, mount_flags))
 		die("Cannot mount diskname");
 
-	if (fs_create(filename)) {
-		fs_umount();
-		die("Cannot create file");
+	for (i = 0; i < batch.count; i++) {
+		struct add_job *job = &batch.jobs[i];
+		int fs_fd;
+
+		if (job->error)
+			continue;
+		if (fs_create(job->name)) {
+			job->error = "Cannot create file";
+			continue;
+		}
+		fs_fd = fs_open(job->name);
+		if (fs_fd < 0) {
+			job->error = "Cannot open file";
+			continue;
+		}
+		/* Without enough room, the copy writes what it can */
+		fs_reserve(fs_fd, job->size);
+		fs_close(fs_fd);
 	}
 
-	fs_fd = fs_open(filename);
+	nworkers = pool_size(batch.count);
+	for (long w = 0; w < nworkers; w++)
+		if (pthread_create(&workers[w], NULL, add_worker, &batch))
+			die_perror("pthread_create");
+	for (long w = 0; w < nworkers; w++)
+		pthread_join(workers[w], NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (i = 0; i < batch.count; i++) {
+		struct add_job *job = &batch.jobs[i];
+
+		if (job->error) {
+			test_fs_error("%s: %s", job->error, job->name);
+			failed = 1;
+		} else {
+			printf("Wrote file '%s' (%d/%zu bytes)\n", job->name,
+			       job->written, job->size);
+		}
+		free(job->path);
+		free(job->name);
+	}
+	free(batch.jobs);
+
+	if (failed)
+		exit(1);
+}
+
+/* Bytes copied by each fs_copy_out() call of the export command */
+#define EXPORT_CHUNK (1 << 20)
+
+/* Files of the export command, shared by the workers */
+struct export_batch {
+	char (*names)[FS_FILENAME_LEN];
+	size_t count;
+	size_t next;			/* Next file to take */
+	const char *dir;		/* Host directory */
+	int failed;
+};
+
+/* Copy file @name to the host directory, a chunk at a time */
+static int export_file(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	int fs_fd, fd, size;
+	int ret = -1;
+
+	/* The name must not lead out of @dir */
+	if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+		test_fs_error("Not a valid host file name: %s", name);
+		return -1;
+	}
+
+	fs_fd = fs_open(name);
 	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
+		test_fs_error("Cannot open file: %s", name);
+		return -1;
 	}
+	size = fs_stat(fs_fd);
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		fs_close(fs_fd);
+		return -1;
+	}
 
-	if (fs_close(fs_fd)) {
+	for (int off = 0; size >= 0 && off < size; off += EXPORT_CHUNK) {
+		int len = size - off < EXPORT_CHUNK ? size - off : EXPORT_CHUNK;
+
+		if (fs_copy_out(fs_fd, off, fd, off, len) != len) {
+			test_fs_error("Cannot copy file: %s", name);
+			goto out;
+		}
+	}
+	ret = size;
+	printf("Exported file '%s' (%d bytes)\n", name, size);
+
+out:
+	close(fd);
+	fs_close(fs_fd);
+	return ret;
+}
+
+static void *export_worker(void *arg)
+{
+	struct export_batch *b = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count)
+		if (export_file(b->dir, b->names[i]) < 0)
+			__atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+	struct export_batch batch = { names, 0, 0, NULL, 0 };
+	pthread_t workers[POOL_MAX_WORKERS];
+	char *diskname, *pattern;
+	long nworkers;
+	int count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [<pattern>]");
+
+	diskname = t_arg->argv[0];
+	batch.dir = t_arg->argv[1];
+	pattern = t_arg->argc > 2 ? t_arg->argv[2] : "*";
+
+	if (mkdir(batch.dir, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	if (fs_mount_flags(diskname, mount_flags))
+		die("Cannot mount diskname");
+
+	count = fs_list(names);
+	if (count < 0) {
 		fs_umount();
-		die("Cannot close file");
+		die("Cannot list files");
 	}
 
+	/* Keep the files matching the pattern, shell style */
+	for (int i = 0; i < count; i++)
+		if (!fnmatch(pattern, names[i], 0))
+			memmove(names[batch.count++], names[i], FS_FILENAME_LEN);
+
+	/* Each worker streams whole files from the image to the host */
+	nworkers = pool_size(batch.count);
+	for (long w = 0; w < nworkers; w++)
+		if (pthread_create(&workers[w], NULL, export_worker, &batch))
+			die_perror("pthread_create");
+	for (long w = 0; w < nworkers; w++)
+		pthread_join(workers[w], NULL);
+
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
-		   st.st_size);
-
-	munmap(buf, st.st_size);
-	close(fd);
+	if (batch.failed)
+		exit(1);
 }
 
 void thread_fs_ls(void *arg)
@@ -471,7 +1095,7 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_flags(diskname, mount_flags | FS_MOUNT_LAZY))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -490,7 +1114,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_mount_flags(diskname, mount_flags))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -507,34 +1131,182 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+/* Blocks moved by each fs_defrag() call of the defrag command */
+#define DEFRAG_STEP 256
+
+void print_frag(const char *when)
+{
+	struct fs_frag frag;
+
+	if (fs_frag(&frag))
+		die("Cannot read the FAT");
+	printf("%s: %u files, %u fragmented, %u extents for %u blocks, score %.3f\n",
+	       when, frag.files, frag.fragmented, frag.extents, frag.blocks,
+	       frag.score);
+}
+
+/* Defragment in steps of a few blocks, as one would on a busy disk */
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct timespec t0, t1;
+	size_t step = DEFRAG_STEP, total = 0;
+	char *diskname;
+	int moved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<blocks per step>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		step = get_argv(t_arg->argv[1]);
+
+	if (fs_mount_flags(diskname, mount_flags))
+		die("Cannot mount diskname");
+
+	print_frag("before");
+	for (int i = 1;; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		moved = fs_defrag(step);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (moved < 0) {
+			fs_umount();
+			die("Cannot defragment diskname");
+		}
+		if (moved == 0)
+			break;
+		total += moved;
+		printf("step %d: moved %d blocks in %.3f ms, %zu in total\n", i,
+		       moved, (t1.tv_sec - t0.tv_sec) * 1e3 +
+		       (t1.tv_nsec - t0.tv_nsec) / 1e6, total);
+	}
+	print_frag("after");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_stats(void *arg);
+
 static struct {
 	const char *name;
 	void(*func)(void *);
+	/* The command modifies the file system */
+	int write;
 } commands[] = {
-	{ "info",	thread_fs_info },
-	{ "ls",		thread_fs_ls },
-	{ "add",	thread_fs_add },
-	{ "rm",		thread_fs_rm },
-	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "info",	thread_fs_info,		0 },
+	{ "ls",		thread_fs_ls,		0 },
+	{ "add",	thread_fs_add,		1 },
+	{ "export",	thread_fs_export,	0 },
+	{ "defrag",	thread_fs_defrag,	1 },
+	{ "rm",		thread_fs_rm,		1 },
+	{ "cat",	thread_fs_cat,		0 },
+	{ "stat",	thread_fs_stat,		0 },
+	{ "script",	thread_fs_script,	1 },
+	{ "stats",	thread_fs_stats,	1 }
 };
 
+/*
+ * Run command @i. Creating a journal changes the layout of the disk, so only
+ * the commands that write do it (an existing journal is always replayed).
+ */
+static void run_command(size_t i, struct thread_arg *arg)
+{
+	if (!commands[i].write)
+		mount_flags &= ~FS_MOUNT_JOURNAL;
+	commands[i].func(arg);
+}
+
 void usage(char *program)
 {
 	size_t i;
-	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "Usage: %s [<option>] <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible options are:\n");
+	fprintf(stderr, "\t--mmap\tmemory-map the disk image\n");
+	fprintf(stderr, "\t--uring\tsubmit block I/O through io_uring\n");
+	fprintf(stderr, "\t--journal\tlog metadata changes, creating a journal if a command writes\n");
+	fprintf(stderr, "\t--lazy\tread FAT blocks on first access\n");
+	fprintf(stderr, "\t--trace <file>\trecord the libfs calls, see replay_fs.x\n");
 	fprintf(stderr, "Possible commands are:\n");
 	for (i = 0; i < ARRAY_SIZE(commands); i++)
 		fprintf(stderr, "\t%s\n", commands[i].name);
 	exit(1);
 }
 
+/* Upper bound, in microseconds, of the latency of fraction q of the calls */
+double hist_percentile(const struct fs_op_stats *op, double q)
+{
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < FS_STATS_BUCKETS - 1; i++) {
+		seen += op->lat_hist[i];
+		if (seen >= q * op->calls)
+			break;
+	}
+	return (double)(2ULL << i) / 1000;
+}
+
+/* Run another command, then print the libfs counters */
+void thread_fs_stats(void *arg)
+{
+	static const char *op_names[FS_STATS_OP_COUNT] = {
+		"mount", "umount", "info", "create", "delete", "ls", "open",
+		"close", "stat", "lseek", "write", "read", "reserve", "flush",
+		"sync", "pwrite", "pread", "writev", "readv", "copy_out",
+		"defrag"
+	};
+	struct thread_arg *t_arg = arg;
+	struct thread_arg sub_arg;
+	struct fs_stats st;
+	size_t i;
+
+	if (t_arg->argc < 1)
+		die("Usage: <command> [<arg>...]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		if (!strcmp(t_arg->argv[0], commands[i].name))
+			break;
+	if (i == ARRAY_SIZE(commands) || commands[i].func == thread_fs_stats)
+		die("invalid command '%s'", t_arg->argv[0]);
+
+	if (fs_stats_reset())
+		die("libfs was built without FS_STATS");
+
+	sub_arg.argc = t_arg->argc - 1;
+	sub_arg.argv = &t_arg->argv[1];
+	run_command(i, &sub_arg);
+
+	fs_stats_get(&st);
+	printf("FS Stats:\n");
+	printf("%-8s %8s %8s %12s %8s %8s %10s %10s %10s\n", "op", "calls",
+	       "errors", "bytes", "blk_rd", "blk_wr", "p50(us)", "p99(us)",
+	       "p999(us)");
+	for (i = 0; i < FS_STATS_OP_COUNT; i++) {
+		struct fs_op_stats *op = &st.ops[i];
+
+		if (op->calls == 0)
+			continue;
+		printf("%-8s %8llu %8llu %12llu %8llu %8llu %10.1f %10.1f %10.1f\n",
+		       op_names[i], (unsigned long long)op->calls,
+		       (unsigned long long)op->errors,
+		       (unsigned long long)op->bytes,
+		       (unsigned long long)op->blk_reads,
+		       (unsigned long long)op->blk_writes,
+		       hist_percentile(op, 0.50), hist_percentile(op, 0.99),
+		       hist_percentile(op, 0.999));
+	}
+	printf("fat_hops=%llu\n", (unsigned long long)st.fat_hops);
+	printf("blk_reads=%llu\n", (unsigned long long)st.blk_reads);
+	printf("blk_writes=%llu\n", (unsigned long long)st.blk_writes);
+}
+
 int main(int argc, char **argv)
 {
 	size_t i;
 	char *program;
 	char *cmd;
+	char *trace = NULL;
 	struct thread_arg arg;
 
 	program = argv[0];
@@ -546,13 +1318,40 @@ int main(int argc, char **argv)
 	argc--;
 	argv++;
 
+	/* Options come before the command */
+	while (argc > 0 && argv[0][0] == '-') {
+		if (!strcmp(argv[0], "--mmap")) {
+			mount_flags |= FS_MOUNT_MMAP;
+		} else if (!strcmp(argv[0], "--uring")) {
+			mount_flags |= FS_MOUNT_URING;
+		} else if (!strcmp(argv[0], "--journal")) {
+			mount_flags |= FS_MOUNT_JOURNAL;
+		} else if (!strcmp(argv[0], "--lazy")) {
+			mount_flags |= FS_MOUNT_LAZY;
+		} else if (!strcmp(argv[0], "--trace") && argc > 1) {
+			trace = *++argv;
+			argc--;
+		} else {
+			test_fs_error("invalid option '%s'", argv[0]);
+			usage(program);
+		}
+		argc--;
+		argv++;
+	}
+
+	if (argc == 0)
+		usage(program);
+
 	cmd = argv[0];
 	arg.argc = --argc;
 	arg.argv = &argv[1];
 
+	if (trace && fs_trace_start(trace))
+		die("Cannot record trace %s", trace);
+
 	for (i = 0; i < ARRAY_SIZE(commands); i++) {
 		if (!strcmp(cmd, commands[i].name)) {
-			commands[i].func(&arg);
+			run_command(i, &arg);
 			break;
 		}
 	}
@@ -561,5 +1360,8 @@ int main(int argc, char **argv)
 		usage(program);
 	}
 
+	if (trace && fs_trace_stop())
+		die("Cannot write trace %s", trace);
+
 	return 0;
 }
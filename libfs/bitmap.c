@@ -0,0 +1,174 @@
+#include <stdlib.h>
+
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86
+#endif
+
+#define WORD_BITS 64
+
+// Return the index of the first word of words[i..n) that is not equal to
+// pattern (all zeros or all ones), or n
+static size_t skip_words_scalar(const uint64_t *words, size_t i, size_t n, uint64_t pattern)
+{
+    while (i < n && words[i] == pattern) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef BITMAP_X86
+// Compare 4 words per iteration
+__attribute__((target("avx2")))
+static size_t skip_words_avx2(const uint64_t *words, size_t i, size_t n, uint64_t pattern)
+{
+    __m256i pat = _mm256_set1_epi64x(pattern);
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat)) != -1) {
+            break;
+        }
+    }
+    return skip_words_scalar(words, i, n, pattern);
+}
+
+// Compare 2 words per iteration
+__attribute__((target("sse2")))
+static size_t skip_words_sse2(const uint64_t *words, size_t i, size_t n, uint64_t pattern)
+{
+    __m128i pat = _mm_set1_epi64x(pattern);
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, pat)) != 0xFFFF) {
+            break;
+        }
+    }
+    return skip_words_scalar(words, i, n, pattern);
+}
+#endif
+
+// Widest implementation supported by the CPU, picked by bitmap_init()
+static size_t (*skip_words)(const uint64_t *, size_t, size_t, uint64_t) = skip_words_scalar;
+
+static void select_skip_words(void)
+{
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        skip_words = skip_words_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        skip_words = skip_words_sse2;
+    }
+#endif
+}
+
+int bitmap_init(struct bitmap *bm, size_t nbits)
+{
+    size_t nwords = (nbits + WORD_BITS - 1) / WORD_BITS;
+
+    select_skip_words();
+
+    bm->words = calloc(nwords ? nwords : 1, sizeof(uint64_t));
+    if (bm->words == NULL) {
+        return -1;
+    }
+    bm->nbits = nbits;
+    bm->nset = 0;
+
+    return 0;
+}
+
+void bitmap_destroy(struct bitmap *bm)
+{
+    free(bm->words);
+    bm->words = NULL;
+    bm->nbits = 0;
+    bm->nset = 0;
+}
+
+void bitmap_set(struct bitmap *bm, size_t i)
+{
+    uint64_t mask = 1ULL << (i % WORD_BITS);
+
+    if (!(bm->words[i / WORD_BITS] & mask)) {
+        bm->words[i / WORD_BITS] |= mask;
+        bm->nset++;
+    }
+}
+
+void bitmap_clear(struct bitmap *bm, size_t i)
+{
+    uint64_t mask = 1ULL << (i % WORD_BITS);
+
+    if (bm->words[i / WORD_BITS] & mask) {
+        bm->words[i / WORD_BITS] &= ~mask;
+        bm->nset--;
+    }
+}
+
+int bitmap_test(const struct bitmap *bm, size_t i)
+{
+    return (bm->words[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+// Find the next bit equal to value at or after start
+static size_t find_bit(const struct bitmap *bm, size_t start, int value)
+{
+    size_t nwords = (bm->nbits + WORD_BITS - 1) / WORD_BITS;
+    size_t wi = start / WORD_BITS;
+    uint64_t skip = value ? 0 : ~0ULL;
+    uint64_t w;
+    size_t i;
+
+    if (start >= bm->nbits) {
+        return BITMAP_NONE;
+    }
+
+    // Look for set bits, in the complemented word when searching for zeros,
+    // ignoring the bits before start in the first word
+    w = (bm->words[wi] ^ skip) & (~0ULL << (start % WORD_BITS));
+    if (w == 0) {
+        wi = skip_words(bm->words, wi + 1, nwords, skip);
+        if (wi == nwords) {
+            return BITMAP_NONE;
+        }
+        w = bm->words[wi] ^ skip;
+    }
+
+    i = wi * WORD_BITS + __builtin_ctzll(w);
+    return i < bm->nbits ? i : BITMAP_NONE;
+}
+
+size_t bitmap_find(const struct bitmap *bm, size_t start)
+{
+    return find_bit(bm, start, 1);
+}
+
+size_t bitmap_find_run(const struct bitmap *bm, size_t start, size_t len)
+{
+    while (1) {
+        size_t first = find_bit(bm, start, 1);
+        size_t end;
+
+        if (first == BITMAP_NONE) {
+            return BITMAP_NONE;
+        }
+        end = find_bit(bm, first, 0);
+        if (end == BITMAP_NONE) {
+            end = bm->nbits;
+        }
+        if (end - first >= len) {
+            return first;
+        }
+        start = end;
+    }
+}
+
+size_t bitmap_count(const struct bitmap *bm)
+{
+    return bm->nset;
+}
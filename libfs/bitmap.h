@@ -0,0 +1,94 @@
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/** Returned by bitmap_find() when no bit is set */
+#define BITMAP_NONE ((size_t)-1)
+
+/*
+ * Fixed-size set of bits keeping track of how many are set. The file system
+ * uses it for free data blocks and root directory slots, and to flag dirty or
+ * journaled FAT blocks. Set bits and runs of set bits, such as free extents,
+ * are searched with SIMD instructions when the CPU supports them.
+ */
+struct bitmap {
+    uint64_t *words;
+    size_t nbits;
+    size_t nset;
+};
+
+/**
+ * bitmap_init - Allocate a bitmap
+ * @bm: Bitmap to initialize
+ * @nbits: Number of bits
+ *
+ * All the bits start cleared.
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int bitmap_init(struct bitmap *bm, size_t nbits);
+
+/**
+ * bitmap_destroy - Release the memory of a bitmap
+ * @bm: Bitmap
+ */
+void bitmap_destroy(struct bitmap *bm);
+
+/**
+ * bitmap_set - Set a bit
+ * @bm: Bitmap
+ * @i: Index of the bit
+ */
+void bitmap_set(struct bitmap *bm, size_t i);
+
+/**
+ * bitmap_clear - Clear a bit
+ * @bm: Bitmap
+ * @i: Index of the bit
+ */
+void bitmap_clear(struct bitmap *bm, size_t i);
+
+/**
+ * bitmap_test - Test a bit
+ * @bm: Bitmap
+ * @i: Index of the bit
+ *
+ * Return: 1 if bit @i is set, 0 otherwise.
+ */
+int bitmap_test(const struct bitmap *bm, size_t i);
+
+/**
+ * bitmap_find - Find the next set bit
+ * @bm: Bitmap
+ * @start: Index to start searching from
+ *
+ * The bitmap is scanned a word at a time, skipping runs of empty words with
+ * AVX2 or SSE2 when the CPU supports it.
+ *
+ * Return: %BITMAP_NONE if no bit is set at or after @start, the index of the
+ * first set bit otherwise.
+ */
+size_t bitmap_find(const struct bitmap *bm, size_t start);
+
+/**
+ * bitmap_find_run - Find a run of consecutive set bits
+ * @bm: Bitmap
+ * @start: Index to start searching from
+ * @len: Minimum length of the run
+ *
+ * Return: %BITMAP_NONE if there is no run of at least @len set bits at or
+ * after @start, the index of the first bit of the first such run otherwise.
+ */
+size_t bitmap_find_run(const struct bitmap *bm, size_t start, size_t len);
+
+/**
+ * bitmap_count - Number of set bits
+ * @bm: Bitmap
+ *
+ * Return: the number of set bits, kept up to date in O(1).
+ */
+size_t bitmap_count(const struct bitmap *bm);
+
+#endif /* _BITMAP_H */
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define NO_LINE -1
+
+// One cached block. Lines are linked in an LRU list (head is the most
+// recently used) and chained in the hash bucket of their block index.
+struct cache_line {
+    size_t block;
+    int valid;
+    int dirty;
+    int prefetched;     // Read ahead and not accessed yet
+    int prev;
+    int next;
+    int hnext;
+};
+
+struct cache {
+    struct disk *disk;
+    size_t nblocks;
+    struct cache_line *lines;
+    char *data;             // nblocks * BLOCK_SIZE bytes, line i at i * BLOCK_SIZE
+    int *buckets;
+    size_t bucket_mask;
+    int lru_head;
+    int lru_tail;
+    pthread_mutex_t lock;   // Protects everything above and the counters
+    size_t ra_issued;       // Blocks read ahead
+    size_t ra_hits;         // Blocks read ahead and accessed afterwards
+};
+
+static size_t hash_block(const struct cache *c, size_t block)
+{
+    // Fibonacci hashing spreads consecutive block indexes over the buckets
+    return (block * 0x9E3779B97F4A7C15ULL) >> 32 & c->bucket_mask;
+}
+
+static char *line_data(struct cache *c, int i)
+{
+    return c->data + (size_t)i * BLOCK_SIZE;
+}
+
+static void lru_unlink(struct cache *c, int i)
+{
+    struct cache_line *l = &c->lines[i];
+
+    if (l->prev != NO_LINE) {
+        c->lines[l->prev].next = l->next;
+    } else {
+        c->lru_head = l->next;
+    }
+    if (l->next != NO_LINE) {
+        c->lines[l->next].prev = l->prev;
+    } else {
+        c->lru_tail = l->prev;
+    }
+}
+
+static void lru_push_head(struct cache *c, int i)
+{
+    struct cache_line *l = &c->lines[i];
+
+    l->prev = NO_LINE;
+    l->next = c->lru_head;
+    if (c->lru_head != NO_LINE) {
+        c->lines[c->lru_head].prev = i;
+    }
+    c->lru_head = i;
+    if (c->lru_tail == NO_LINE) {
+        c->lru_tail = i;
+    }
+}
+
+// Account for an access to line i
+static void line_hit(struct cache *c, int i)
+{
+    if (c->lines[i].prefetched) {
+        c->lines[i].prefetched = 0;
+        c->ra_hits++;
+    }
+}
+
+static int hash_find(struct cache *c, size_t block)
+{
+    int i = c->buckets[hash_block(c, block)];
+
+    while (i != NO_LINE && c->lines[i].block != block) {
+        i = c->lines[i].hnext;
+    }
+    return i;
+}
+
+static void hash_remove(struct cache *c, int i)
+{
+    int *pi = &c->buckets[hash_block(c, c->lines[i].block)];
+
+    while (*pi != i) {
+        pi = &c->lines[*pi].hnext;
+    }
+    *pi = c->lines[i].hnext;
+}
+
+static void hash_insert(struct cache *c, int i)
+{
+    size_t h = hash_block(c, c->lines[i].block);
+
+    c->lines[i].hnext = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+struct cache *cache_create(struct disk *d, size_t nblocks)
+{
+    struct cache *c = calloc(1, sizeof(*c));
+    size_t nbuckets = 1;
+
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->disk = d;
+    c->nblocks = nblocks;
+    c->lru_head = NO_LINE;
+    c->lru_tail = NO_LINE;
+    pthread_mutex_init(&c->lock, NULL);
+    if (nblocks == 0) {
+        return c;
+    }
+
+    // Keep the load factor of the hash table under 1/2
+    while (nbuckets < 2 * nblocks) {
+        nbuckets <<= 1;
+    }
+    c->bucket_mask = nbuckets - 1;
+
+    c->lines = calloc(nblocks, sizeof(struct cache_line));
+    c->buckets = malloc(nbuckets * sizeof(int));
+    c->data = malloc(nblocks * BLOCK_SIZE);
+    if (c->lines == NULL || c->buckets == NULL || c->data == NULL) {
+        cache_destroy(c);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < nbuckets; i++) {
+        c->buckets[i] = NO_LINE;
+    }
+    // All lines start invalid, anywhere in the LRU list is fine
+    for (size_t i = 0; i < nblocks; i++) {
+        lru_push_head(c, i);
+    }
+
+    return c;
+}
+
+void cache_destroy(struct cache *c)
+{
+    if (c == NULL) {
+        return;
+    }
+    free(c->lines);
+    free(c->buckets);
+    free(c->data);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+// Unbind line @i from its block and make it the next one to be evicted
+static void cache_drop(struct cache *c, int i)
+{
+    hash_remove(c, i);
+    c->lines[i].valid = 0;
+    c->lines[i].dirty = 0;
+    c->lines[i].prefetched = 0;
+    lru_unlink(c, i);
+    c->lines[i].prev = c->lru_tail;
+    c->lines[i].next = NO_LINE;
+    if (c->lru_tail != NO_LINE) {
+        c->lines[c->lru_tail].next = i;
+    }
+    c->lru_tail = i;
+    if (c->lru_head == NO_LINE) {
+        c->lru_head = i;
+    }
+}
+
+// Take the least recently used line and rebind it to @block. The returned
+// line is at the head of the LRU list but its data is stale.
+static int cache_evict(struct cache *c, size_t block)
+{
+    int i = c->lru_tail;
+    struct cache_line *l = &c->lines[i];
+
+    if (l->valid) {
+        if (l->dirty && disk_write(c->disk, l->block, line_data(c, i)) == -1) {
+            return NO_LINE;
+        }
+        hash_remove(c, i);
+    }
+
+    l->block = block;
+    l->valid = 1;
+    l->dirty = 0;
+    l->prefetched = 0;
+    hash_insert(c, i);
+    lru_unlink(c, i);
+    lru_push_head(c, i);
+
+    return i;
+}
+
+// Return the line holding block, loading it in the cache first if needed.
+// The block is only read from disk if load is set, otherwise the line is
+// zero-filled.
+static int cache_get(struct cache *c, size_t block, int load)
+{
+    int i = hash_find(c, block);
+
+    if (i != NO_LINE) {
+        lru_unlink(c, i);
+        lru_push_head(c, i);
+        line_hit(c, i);
+        return i;
+    }
+
+    i = cache_evict(c, block);
+    if (i == NO_LINE) {
+        return NO_LINE;
+    }
+    if (!load) {
+        memset(line_data(c, i), 0, BLOCK_SIZE);
+    } else if (disk_read(c->disk, block, line_data(c, i)) == -1) {
+        cache_drop(c, i);
+        return NO_LINE;
+    }
+
+    return i;
+}
+
+int cache_read_at(struct cache *c, size_t block, size_t offset, size_t len,
+                  void *buf)
+{
+    char tmp[BLOCK_SIZE];
+    char *data;
+    int i;
+
+    if (c->nblocks == 0) {
+        // A mapped disk is read in place
+        data = disk_map(c->disk, block);
+        if (data == NULL) {
+            if (disk_read(c->disk, block, tmp) == -1) {
+                return -1;
+            }
+            data = tmp;
+        }
+        memcpy(buf, data + offset, len);
+        return 0;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    i = hash_find(c, block);
+    if (i != NO_LINE) {
+        lru_unlink(c, i);
+        lru_push_head(c, i);
+        line_hit(c, i);
+        memcpy(buf, line_data(c, i) + offset, len);
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    // Read outside of the lock so that the misses of several threads overlap
+    if (disk_read(c->disk, block, tmp) == -1) {
+        return -1;
+    }
+    memcpy(buf, tmp + offset, len);
+
+    // Another thread may have loaded the block in the meantime
+    pthread_mutex_lock(&c->lock);
+    if (hash_find(c, block) == NO_LINE) {
+        i = cache_evict(c, block);
+        if (i != NO_LINE) {
+            memcpy(line_data(c, i), tmp, BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+int cache_write_at(struct cache *c, size_t block, size_t offset, size_t len,
+                   const void *buf, int keep)
+{
+    int full = (offset == 0 && len == BLOCK_SIZE);
+    char tmp[BLOCK_SIZE];
+    char *data;
+
+    if (c->nblocks == 0) {
+        data = disk_map(c->disk, block);
+        if (data != NULL) {
+            memcpy(data + offset, buf, len);
+            return 0;
+        }
+        if (full) {
+            return disk_write(c->disk, block, buf);
+        }
+        // Merge the new bytes in a temporary block
+        if (!keep) {
+            memset(tmp, 0, BLOCK_SIZE);
+        } else if (disk_read(c->disk, block, tmp) == -1) {
+            return -1;
+        }
+        memcpy(tmp + offset, buf, len);
+        return disk_write(c->disk, block, tmp);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    int i = cache_get(c, block, keep && !full);
+    if (i == NO_LINE) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    memcpy(line_data(c, i) + offset, buf, len);
+    c->lines[i].dirty = 1;
+    pthread_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+int cache_readv(struct cache *c, const size_t *blocks, void *const *bufs,
+                size_t count)
+{
+    size_t miss_blocks[CACHE_SPAN_MAX];
+    void *miss_bufs[CACHE_SPAN_MAX];
+
+    for (size_t first = 0; first < count; first += CACHE_SPAN_MAX) {
+        size_t end = count - first < CACHE_SPAN_MAX ? count : first + CACHE_SPAN_MAX;
+        size_t nmiss = 0;
+
+        pthread_mutex_lock(&c->lock);
+        for (size_t j = first; j < end; j++) {
+            int i = c->nblocks ? hash_find(c, blocks[j]) : NO_LINE;
+
+            if (i != NO_LINE) {
+                lru_unlink(c, i);
+                lru_push_head(c, i);
+                line_hit(c, i);
+                memcpy(bufs[j], line_data(c, i), BLOCK_SIZE);
+                continue;
+            }
+            // Misses go straight to the caller's buffers without filling the
+            // cache, so one large read does not wipe out the hot blocks
+            miss_blocks[nmiss] = blocks[j];
+            miss_bufs[nmiss] = bufs[j];
+            nmiss++;
+        }
+        pthread_mutex_unlock(&c->lock);
+
+        if (disk_readv(c->disk, miss_blocks, miss_bufs, nmiss) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int cache_prefetch(struct cache *c, const size_t *blocks, size_t count)
+{
+    size_t miss_blocks[CACHE_SPAN_MAX];
+    void *miss_bufs[CACHE_SPAN_MAX];
+    size_t nmiss = 0;
+    char *data;
+
+    // Never let read-ahead evict more than half of the cache
+    if (count > c->nblocks / 2) {
+        count = c->nblocks / 2;
+    }
+    if (count > CACHE_SPAN_MAX) {
+        count = CACHE_SPAN_MAX;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for (size_t j = 0; j < count; j++) {
+        if (hash_find(c, blocks[j]) == NO_LINE) {
+            miss_blocks[nmiss++] = blocks[j];
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (nmiss == 0) {
+        return 0;
+    }
+
+    // The blocks are read outside of the lock, then inserted
+    data = malloc(nmiss * BLOCK_SIZE);
+    if (data == NULL) {
+        return -1;
+    }
+    for (size_t j = 0; j < nmiss; j++) {
+        miss_bufs[j] = data + j * BLOCK_SIZE;
+    }
+    if (disk_readv(c->disk, miss_blocks, miss_bufs, nmiss) == -1) {
+        free(data);
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for (size_t j = 0; j < nmiss; j++) {
+        if (hash_find(c, miss_blocks[j]) != NO_LINE) {
+            continue;
+        }
+        int i = cache_evict(c, miss_blocks[j]);
+        if (i == NO_LINE) {
+            break;
+        }
+        memcpy(line_data(c, i), miss_bufs[j], BLOCK_SIZE);
+        c->lines[i].prefetched = 1;
+        c->ra_issued++;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    free(data);
+    return 0;
+}
+
+void cache_ra_stats(struct cache *c, size_t *issued, size_t *hits)
+{
+    pthread_mutex_lock(&c->lock);
+    *issued = c->ra_issued;
+    *hits = c->ra_hits;
+    pthread_mutex_unlock(&c->lock);
+}
+
+int cache_writev(struct cache *c, const size_t *blocks, const void *const *bufs,
+                 size_t count)
+{
+    pthread_mutex_lock(&c->lock);
+    for (size_t j = 0; c->nblocks && j < count; j++) {
+        int i = hash_find(c, blocks[j]);
+
+        // The block is entirely overwritten, even a dirty copy is stale
+        if (i != NO_LINE) {
+            cache_drop(c, i);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return disk_writev(c->disk, blocks, bufs, count);
+}
+
+static int cmp_line_block(const void *a, const void *b, void *arg)
+{
+    const struct cache *c = arg;
+    size_t ba = c->lines[*(const int *)a].block;
+    size_t bb = c->lines[*(const int *)b].block;
+
+    return (ba > bb) - (ba < bb);
+}
+
+int cache_flush(struct cache *c)
+{
+    size_t blocks[CACHE_SPAN_MAX];
+    const void *bufs[CACHE_SPAN_MAX];
+    int *dirty;
+    size_t ndirty = 0;
+    int ret = 0;
+
+    if (c->nblocks == 0) {
+        return 0;
+    }
+
+    dirty = malloc(c->nblocks * sizeof(int));
+    if (dirty == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&c->lock);
+    for (size_t i = 0; i < c->nblocks; i++) {
+        if (c->lines[i].valid && c->lines[i].dirty) {
+            dirty[ndirty++] = i;
+        }
+    }
+
+    // Write back in block order so consecutive dirty blocks share a pwritev()
+    qsort_r(dirty, ndirty, sizeof(int), cmp_line_block, c);
+    for (size_t j = 0; j < ndirty; j += CACHE_SPAN_MAX) {
+        size_t n = ndirty - j < CACHE_SPAN_MAX ? ndirty - j : CACHE_SPAN_MAX;
+
+        for (size_t k = 0; k < n; k++) {
+            blocks[k] = c->lines[dirty[j + k]].block;
+            bufs[k] = line_data(c, dirty[j + k]);
+        }
+        if (disk_writev(c->disk, blocks, bufs, n) == -1) {
+            ret = -1;
+            continue;
+        }
+        for (size_t k = 0; k < n; k++) {
+            c->lines[dirty[j + k]].dirty = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&c->lock);
+    free(dirty);
+    return ret;
+}
@@ -0,0 +1,142 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Default number of blocks held by the block cache */
+#define CACHE_DEFAULT_BLOCKS 64
+
+/** Maximum number of blocks handled by one internal vectored request */
+#define CACHE_SPAN_MAX 256
+
+/* Opaque block cache instance */
+struct cache;
+
+/* Disk the cache sits on, see disk.h */
+struct disk;
+
+/**
+ * cache_create - Create a block cache
+ * @d: Disk the cached blocks belong to
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Create a write-back LRU cache sitting on top of disk_read() and
+ * disk_write(). A cache of size 0 is valid and passes every request straight
+ * through to the disk.
+ *
+ * The cache can be used by several threads at once. Read misses are served
+ * outside of its lock, so a block must not be written while another thread
+ * reads it.
+ *
+ * Return: NULL if memory cannot be allocated, the new cache otherwise.
+ */
+struct cache *cache_create(struct disk *d, size_t nblocks);
+
+/**
+ * cache_destroy - Release a block cache
+ * @c: Cache to release
+ *
+ * Dirty blocks are NOT written back, call cache_flush() first.
+ */
+void cache_destroy(struct cache *c);
+
+/**
+ * cache_read_at - Read part of a block through the cache
+ * @c: Cache
+ * @block: Index of the block to read from
+ * @offset: Offset of the first byte to read within the block
+ * @len: Number of bytes to read, @offset + @len must not exceed %BLOCK_SIZE
+ * @buf: Data buffer of @len bytes to be filled
+ *
+ * On a cache miss, the whole block is read in the cache first. With a cache of
+ * size 0, the block is read in place when the disk is memory-mapped and in a
+ * temporary block otherwise.
+ *
+ * Return: -1 if the block had to be fetched and disk_read() failed, or if a
+ * dirty block could not be evicted. 0 otherwise.
+ */
+int cache_read_at(struct cache *c, size_t block, size_t offset, size_t len,
+                  void *buf);
+
+/**
+ * cache_write_at - Write part of a block through the cache
+ * @c: Cache
+ * @block: Index of the block to write to
+ * @offset: Offset of the first byte to write within the block
+ * @len: Number of bytes to write, @offset + @len must not exceed %BLOCK_SIZE
+ * @buf: Data buffer of @len bytes to write
+ * @keep: Whether the rest of the block holds data that must be preserved
+ *
+ * The block is only marked dirty, it reaches the disk when it gets evicted or
+ * when cache_flush() is called. If the block is not cached, it is only read
+ * from disk when @keep is set and the write does not cover it entirely;
+ * otherwise the rest of the block is zero-filled.
+ *
+ * Return: -1 if the block had to be fetched and disk_read() failed, or if a
+ * dirty block could not be evicted. 0 otherwise.
+ */
+int cache_write_at(struct cache *c, size_t block, size_t offset, size_t len,
+                   const void *buf, int keep);
+
+/**
+ * cache_readv - Read scattered blocks through the cache
+ * @c: Cache
+ * @blocks: Array of @count block indexes
+ * @bufs: Array of @count data buffers of %BLOCK_SIZE bytes each
+ * @count: Number of blocks to read
+ *
+ * Cached blocks are copied from the cache, the other ones are read straight
+ * into @bufs with disk_readv() and are not inserted in the cache.
+ *
+ * Return: -1 if reading one of the missing blocks failed. 0 otherwise.
+ */
+int cache_readv(struct cache *c, const size_t *blocks, void *const *bufs,
+                size_t count);
+
+/**
+ * cache_prefetch - Read blocks ahead into the cache
+ * @c: Cache
+ * @blocks: Array of @count block indexes
+ * @count: Number of blocks to prefetch
+ *
+ * The blocks that are not cached yet are read with a single disk_readv() call
+ * and inserted in the cache. At most half of the cache is used, so that
+ * read-ahead cannot flush the whole working set. Nothing is done with a cache
+ * of size 0.
+ *
+ * Return: -1 if the read failed. 0 otherwise.
+ */
+int cache_prefetch(struct cache *c, const size_t *blocks, size_t count);
+
+/**
+ * cache_ra_stats - Get read-ahead statistics
+ * @c: Cache
+ * @issued: Filled with the number of blocks read by cache_prefetch()
+ * @hits: Filled with how many of them were accessed before being evicted
+ */
+void cache_ra_stats(struct cache *c, size_t *issued, size_t *hits);
+
+/**
+ * cache_writev - Write scattered full blocks, bypassing the cache
+ * @c: Cache
+ * @blocks: Array of @count block indexes
+ * @bufs: Array of @count data buffers of %BLOCK_SIZE bytes each
+ * @count: Number of blocks to write
+ *
+ * The blocks are written straight to the disk with disk_writev() and any
+ * cached copy of them is dropped.
+ *
+ * Return: -1 if one of the writes failed. 0 otherwise.
+ */
+int cache_writev(struct cache *c, const size_t *blocks, const void *const *bufs,
+                 size_t count);
+
+/**
+ * cache_flush - Write back every dirty block
+ * @c: Cache
+ *
+ * Return: -1 if one of the writes failed. 0 otherwise.
+ */
+int cache_flush(struct cache *c);
+
+#endif /* _CACHE_H */
@@ -1,11 +1,20 @@
 #ifndef _DISK_H
 #define _DISK_H
 
-/**
- * WARNING: YOU ARE NOT ALLOWED TO MODIFY THIS FILE!
+/*
+ * Virtual disk: a host file accessed in blocks of %BLOCK_SIZE bytes.
+ *
+ * The block_* functions work on the single disk opened by block_disk_open(),
+ * the disk_* functions on any number of handles returned by disk_open().
+ * Blocks move one at a time, as ranges or scattered, through read/write calls,
+ * a memory mapping or io_uring, with the same results whatever the backend.
+ * The file holds nothing but the blocks, so that images stay interchangeable
+ * with the reference tools (fs_make.x and fs_ref.x).
  */
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/types.h> /* for off_t */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
@@ -23,6 +32,30 @@
  */
 int block_disk_open(const char *diskname);
 
+/** Map the virtual disk file in memory instead of using read/write calls */
+#define BLOCK_DISK_MMAP 0x1
+
+/** Submit multi-block transfers through io_uring, when the kernel allows it */
+#define BLOCK_DISK_URING 0x2
+
+/**
+ * block_disk_open_flags - Open virtual disk file with a given backend
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of BLOCK_DISK_* flags, 0 for the default backend
+ *
+ * Same as block_disk_open(). With %BLOCK_DISK_MMAP, the whole file is mapped
+ * in memory and block accesses become memory copies, which only reach the file
+ * when the kernel writes the pages back or when block_disk_sync() is called.
+ * With %BLOCK_DISK_URING, block_readv() and block_writev() keep all the runs of
+ * consecutive blocks in flight at once through an io_uring submission queue;
+ * if io_uring is unavailable the regular synchronous calls are used instead.
+ * %BLOCK_DISK_MMAP takes precedence over %BLOCK_DISK_URING.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -38,6 +71,26 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_map - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Return: NULL if there is no virtual disk file opened, if it was not opened
+ * with %BLOCK_DISK_MMAP, or if @block is out of bounds. Otherwise the address
+ * of the block inside the mapping, which stays valid until block_disk_close().
+ */
+void *block_disk_map(size_t block);
+
+/**
+ * block_disk_sync - Flush the virtual disk file to stable storage
+ *
+ * Use msync() on a mapped disk and fsync() otherwise.
+ *
+ * Return: -1 if there is no virtual disk file opened or if syncing failed. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -64,5 +117,159 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer of @count * %BLOCK_SIZE bytes
+ *
+ * Write blocks @block to @block + @count - 1 with a single positional write.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer of @count * %BLOCK_SIZE bytes to be filled
+ *
+ * Read blocks @block to @block + @count - 1 with a single positional read.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_writev - Write scattered blocks to disk
+ * @blocks: Array of @count block indexes
+ * @bufs: Array of @count data buffers of %BLOCK_SIZE bytes each
+ * @count: Number of blocks to write
+ *
+ * Write buffer @bufs[i] in block @blocks[i]. Runs of consecutive block indexes
+ * are written with a single vectored write (pwritev()), so the number of
+ * system calls depends on how fragmented @blocks is, not on @count.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible or if one
+ * of the writing operations fails. 0 otherwise.
+ */
+int block_writev(const size_t *blocks, const void *const *bufs, size_t count);
+
+/**
+ * block_readv - Read scattered blocks from disk
+ * @blocks: Array of @count block indexes
+ * @bufs: Array of @count data buffers of %BLOCK_SIZE bytes each
+ * @count: Number of blocks to read
+ *
+ * Read block @blocks[i] into buffer @bufs[i], one vectored read (preadv()) per
+ * run of consecutive block indexes.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible or if one
+ * of the reading operations fails. 0 otherwise.
+ */
+int block_readv(const size_t *blocks, void *const *bufs, size_t count);
+
+/*
+ * Several virtual disk files can be open at the same time through disk
+ * handles. The block_* functions above operate on a single implicit disk; each
+ * of them has a disk_* counterpart taking the disk as first argument, with the
+ * same semantics and return values.
+ */
+
+/* Opaque virtual disk instance */
+struct disk;
+
+/**
+ * disk_open - Open a virtual disk file and get a handle on it
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of BLOCK_DISK_* flags, 0 for the default backend
+ *
+ * Same as block_disk_open_flags(), except that any number of disks can be
+ * open at once. A handle can be used by several threads at the same time.
+ *
+ * Return: NULL if @diskname is invalid, or if the virtual disk file cannot be
+ * opened or mapped. The new disk handle otherwise.
+ */
+struct disk *disk_open(const char *diskname, int flags);
+
+/**
+ * disk_close - Close a virtual disk file and release its handle
+ * @d: Disk handle
+ *
+ * Return: -1 if @d is NULL. 0 otherwise.
+ */
+int disk_close(struct disk *d);
+
+int disk_count(struct disk *d);
+void *disk_map(struct disk *d, size_t block);
+int disk_sync(struct disk *d);
+int disk_write(struct disk *d, size_t block, const void *buf);
+int disk_read(struct disk *d, size_t block, void *buf);
+int disk_write_range(struct disk *d, size_t block, size_t count,
+		     const void *buf);
+int disk_read_range(struct disk *d, size_t block, size_t count, void *buf);
+int disk_writev(struct disk *d, const size_t *blocks, const void *const *bufs,
+		size_t count);
+int disk_readv(struct disk *d, const size_t *blocks, void *const *bufs,
+	       size_t count);
+
+/**
+ * disk_copy_out - Copy bytes of a disk to another file
+ * @d: Disk handle
+ * @block: Index of the first block to copy from
+ * @offset: Offset of the first byte to copy within @block
+ * @len: Number of bytes to copy, possibly over several consecutive blocks
+ * @out_fd: File descriptor to copy to
+ * @out_offset: Offset in @out_fd to copy to
+ *
+ * The data is copied by the kernel with copy_file_range() when possible, and
+ * through a bounded buffer otherwise, or straight from the mapping of a disk
+ * opened with BLOCK_DISK_MMAP. The file offset of @out_fd is not changed.
+ *
+ * Return: -1 if the blocks are out of bounds or if the copy failed. 0
+ * otherwise.
+ */
+int disk_copy_out(struct disk *d, size_t block, size_t offset, size_t len,
+		  int out_fd, off_t out_offset);
+
+/**
+ * disk_stats - Get the number of blocks transferred
+ * @reads: Filled with the number of blocks read
+ * @writes: Filled with the number of blocks written
+ *
+ * The counts cover every disk and the block_* functions, since the library
+ * was loaded or since the last disk_stats_reset(). They stay 0 unless the
+ * library is built with FS_STATS.
+ */
+void disk_stats(uint64_t *reads, uint64_t *writes);
+
+/**
+ * disk_stats_reset - Reset the counts returned by disk_stats()
+ */
+void disk_stats_reset(void);
+
+/**
+ * disk_thread_stats - Get the number of blocks transferred by this thread
+ * @reads: Filled with the number of blocks read by the calling thread
+ * @writes: Filled with the number of blocks written by the calling thread
+ *
+ * Comparing the counts before and after a call tells how many blocks the call
+ * transferred. Never reset, and 0 unless the library is built with FS_STATS.
+ */
+void disk_thread_stats(uint64_t *reads, uint64_t *writes);
+
+/**
+ * disk_io_stats - Get the number of blocks transferred through a disk
+ * @d: Disk handle
+ * @reads: Filled with the number of blocks read since disk_open()
+ * @writes: Filled with the number of blocks written since disk_open()
+ *
+ * The counts stay 0 unless the library is built with FS_STATS.
+ */
+void disk_io_stats(struct disk *d, uint64_t *reads, uint64_t *writes);
+
 #endif /* _DISK_H */
 
@@ -1,15 +1,32 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "bitmap.h"
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
 #define FAT_EOC 0xFFFF
 #define SUPER_BLK_IDX 0
+#define ALLOC_WINDOW 64     // Free blocks set aside when a file starts a new extent
+#define RA_MIN_BLKS 4       // Read-ahead window when sequential access starts
+#define RA_MAX_BLKS 64      // Largest read-ahead window
+#define NAME_BUCKETS 256    // Buckets of the file name index, a power of 2
+#define NO_SLOT -1
+#define JRNL_MIN_BLKS 16    // Smallest journal created by fs_mount_flags()
+#define DEFRAG_BATCH 64     // Blocks fs_defrag() copies at once
+#define FAT_PER_BLK (BLOCK_SIZE / sizeof(uint16_t))
 
 /* TODO: Phase 1 */
 // Data structures of blocks
@@ -20,7 +37,12 @@ struct superblock {
     uint16_t data_idx;         // Data block start index
     uint16_t data_block_num;
     uint8_t fat_blk_num;
-    char padding[4079];
+    // Metadata journal, present when jrnl_magic is JRNL_MAGIC
+    uint32_t jrnl_magic;
+    uint16_t jrnl_start;       // First block of the journal region
+    uint16_t jrnl_blk_num;
+    uint32_t jrnl_seq;         // Sequence number of the first live transaction
+    char padding[4067];
 } __attribute__ ((packed));
 
 struct root {
@@ -30,468 +52,2591 @@ struct root {
     char padding[10];
 }__attribute__((packed));
 
+// Logical to physical block map of a file. It holds a prefix of the file's
+// FAT chain and only grows when a block past it is accessed.
+struct blk_map {
+    uint16_t *blks;     // FAT index of each logical block
+    size_t len;         // Number of valid entries
+    size_t cap;
+    pthread_mutex_t lock;   // Readers of the file extend the map concurrently
+};
+
 struct fd_table {
     int seat;   // Reveal the position is occupied by a fd or not
     int root_idx;   // Corresponding root index in root data structure
-    int cur_data_blk;   // The i-th data block for offset
     size_t offset;  // Current offset of the file
+    size_t ra_last_end;     // Offset right after the previous read
+    size_t ra_window;       // Read-ahead window in blocks, 0 for random access
+    size_t ra_end;          // Logical block right after the last prefetched one
+    pthread_mutex_t lock;   // Held during every operation on the fd
+};
+
+// A mounted file system
+struct fs {
+    struct disk *disk;
+    struct superblock super_blk;
+    uint16_t* fat_entries;      // Whole FAT, NULL when loaded lazily
+    // Lazily loaded FAT: block i is fat_blks[i], NULL until first accessed.
+    // Every block is scanned into free_blks the first time it is loaded.
+    int fat_lazy;
+    uint16_t **fat_blks;
+    size_t fat_resident;        // Number of loaded blocks
+    size_t fat_budget;          // Most blocks kept loaded, 0 for no limit
+    size_t fat_hand;            // Next block to consider for eviction
+    struct bitmap fat_scanned;
+    int fat_all_scanned;        // free_blks covers the whole disk
+    pthread_mutex_t fat_lock;   // Protects the fields above, and free_blks
+                                // while fat_all_scanned is not set
+    struct root rt_local[FS_FILE_MAX_COUNT];
+    struct root *rt_dirt;
+    int in_place;   // FAT and root directory live in the disk mapping
+    struct fd_table opened_fd[FS_OPEN_MAX_COUNT];
+    struct blk_map file_maps[FS_FILE_MAX_COUNT];
+    struct bitmap free_blks;    // One bit per data block, set when the block is free
+    size_t alloc_rotor;         // Where to look for the next new extent
+    struct cache *blk_cache;
+    size_t cache_blocks;
+    // Index of the root directory: file name hash chains of slots, and free slots
+    int name_buckets[NAME_BUCKETS];
+    int name_next[FS_FILE_MAX_COUNT];
+    struct bitmap free_slots;
+    // Metadata blocks that changed since they were last written
+    struct bitmap fat_dirty;    // One bit per FAT block
+    int rdir_dirty;
+    // Metadata journal
+    struct journal jrnl;
+    int journaled;              // Metadata changes go through jrnl
+    struct bitmap fat_logged;   // FAT blocks committed to the journal, not home yet
+    int rdir_logged;
+    // Blocks freed since the last commit. Replaying the journal after a crash
+    // would give them back to their file, so they are not reused before that.
+    struct bitmap freed_blks;
+    int defrag_packing;         // fsi_defrag() packs the files, see defrag_locked()
+
+    // Locking. fs_lock is held shared by the operations on open files and
+    // exclusively by the ones on the directory or the whole file system. Each
+    // file also has a lock held shared by its readers and exclusively by its
+    // writers, and each fd a mutex for its offset, which positional reads and
+    // writes release once they hold the file. alloc_lock protects the FAT,
+    // the free block bitmaps and the dirty metadata flags. Pending fsi_sync()
+    // requests wait for exclusive access, so they are not starved by a stream
+    // of readers.
+    pthread_rwlock_t fs_lock;
+    pthread_rwlock_t file_locks[FS_FILE_MAX_COUNT];
+    pthread_mutex_t fd_lock;    // Seats of opened_fd
+    pthread_mutex_t alloc_lock;
+    // Group commit of fsi_sync()
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_cond;
+    int sync_running;
+    unsigned long sync_gen;     // Number of completed syncs
+    int sync_ret;               // Result of the last one
+
+    // Bytes moved by fsi_read() and fsi_write() since mount, in total and per
+    // file, along with the disk traffic of those calls for the files
+    struct fs_amp amp;
+    struct fs_amp file_amp[FS_FILE_MAX_COUNT];
 };
 
-struct superblock super_blk;
-uint16_t* fat_entries;
-struct root rt_dirt[FS_FILE_MAX_COUNT];
-int is_mount = 0;
-struct fd_table opened_fd[FS_OPEN_MAX_COUNT];
+#ifdef FS_STATS
+// Counters of all the instances, see fs_stats_get()
+static struct fs_stats stats;
+
+// Account for a call to op started at mark m, and pass its result ret through
+static int stats_ret(int op, const struct stats_mark *m, int ret) {
+    uint64_t ns = stats_now() - m->ns;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    uint64_t reads, writes;
+
+    if (bucket >= FS_STATS_BUCKETS) {
+        bucket = FS_STATS_BUCKETS - 1;
+    }
+    disk_thread_stats(&reads, &writes);
+    STATS_ADD(stats.ops[op].calls, 1);
+    STATS_ADD(stats.ops[op].lat_hist[bucket], 1);
+    STATS_ADD(stats.ops[op].blk_reads, reads - m->reads);
+    STATS_ADD(stats.ops[op].blk_writes, writes - m->writes);
+    if (ret < 0) {
+        STATS_ADD(stats.ops[op].errors, 1);
+    } else if (op == FS_STATS_READ || op == FS_STATS_WRITE ||
+               op == FS_STATS_PREAD || op == FS_STATS_PWRITE ||
+               op == FS_STATS_READV || op == FS_STATS_WRITEV ||
+               op == FS_STATS_COPY_OUT) {
+        STATS_ADD(stats.ops[op].bytes, ret);
+    }
+
+    if (trace_active()) {
+        struct trace_rec rec = {
+            .start_ns = trace_since(m->ns),
+            .arg = m->arg,
+            .offset = m->offset,
+            .dur_ns = ns > UINT32_MAX ? UINT32_MAX : ns,
+            .ret = ret,
+            .fd = m->fd,
+            .op = op,
+            .name_len = m->name ? strnlen(m->name, FS_FILENAME_LEN) : 0,
+        };
+        trace_write(&rec, m->name);
+    }
+    return ret;
+}
+
+// Account for ret bytes moved through file root_idx by a call started at mark
+// m, which holds the file
+static void stats_file(struct fs *fs, int root_idx, const struct stats_mark *m, int write, int ret) {
+    struct fs_amp *file = &fs->file_amp[root_idx];
+    uint64_t reads, writes;
+
+    if (ret <= 0) {
+        return;
+    }
+    disk_thread_stats(&reads, &writes);
+    STATS_ADD(file->physical_read, (reads - m->reads) * BLOCK_SIZE);
+    STATS_ADD(file->physical_written, (writes - m->writes) * BLOCK_SIZE);
+    if (write) {
+        STATS_ADD(file->logical_written, ret);
+        STATS_ADD(fs->amp.logical_written, ret);
+    } else {
+        STATS_ADD(file->logical_read, ret);
+        STATS_ADD(fs->amp.logical_read, ret);
+    }
+}
+
+#define STATS_RET(op, m, ret) stats_ret(op, &(m), ret)
+#define STATS_FILE(fs, root_idx, m, write, ret) stats_file(fs, root_idx, &(m), write, ret)
+#else
+#define STATS_RET(op, m, ret) (ret)
+#define STATS_FILE(fs, root_idx, m, write, ret) do { } while (0)
+#endif
 
-void ini_fdt(struct fd_table *fdt) {
+static void ini_fdt(struct fd_table *fdt) {
     for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
         fdt[i].seat = 0;
     }
 }
 
-int fs_mount(const char *diskname)
-{
-	/* TODO: Phase 1 */
-    if (block_disk_open(diskname) == -1) {
-        return -1;
+// Drop loaded FAT blocks until the budget allows one more. Blocks that are
+// not at their home location yet stay loaded, even over budget.
+static void fat_evict(struct fs *fs) {
+    size_t tries = fs->super_blk.fat_blk_num;
+    while (fs->fat_budget && fs->fat_resident >= fs->fat_budget && tries-- > 0) {
+        size_t b = fs->fat_hand;
+        fs->fat_hand = (b + 1) % fs->super_blk.fat_blk_num;
+        if (fs->fat_blks[b] == NULL || bitmap_test(&fs->fat_dirty, b) || bitmap_test(&fs->fat_logged, b)) {
+            continue;
+        }
+        free(fs->fat_blks[b]);
+        fs->fat_blks[b] = NULL;
+        fs->fat_resident--;
     }
+}
 
-    // Read Superblock
-    if(block_read(SUPER_BLK_IDX, (void*)&super_blk) == -1) {
-        return -1;
+// Return FAT block b, reading it first if needed, or NULL if that failed.
+// fat_lock must be held.
+static uint16_t *fat_load(struct fs *fs, size_t b) {
+    if (fs->fat_blks[b] != NULL) {
+        return fs->fat_blks[b];
     }
 
-    if (memcmp(&super_blk.signature, "ECS150FS", 8) != 0) {
-        return -1;
+    fat_evict(fs);
+    uint16_t *blk = malloc(BLOCK_SIZE);
+    if (blk == NULL || disk_read(fs->disk, SUPER_BLK_IDX + 1 + b, blk) == -1) {
+        free(blk);
+        return NULL;
+    }
+    fs->fat_blks[b] = blk;
+    fs->fat_resident++;
+
+    if (!bitmap_test(&fs->fat_scanned, b)) {
+        for (size_t i = 0; i < FAT_PER_BLK; i++) {
+            size_t idx = b * FAT_PER_BLK + i;
+            if (idx > 0 && idx < fs->super_blk.data_block_num && blk[i] == 0) {
+                bitmap_set(&fs->free_blks, idx);
+            }
+        }
+        bitmap_set(&fs->fat_scanned, b);
     }
+    return blk;
+}
 
-    if (super_blk.total_blk_num != block_disk_count()) {
-        return -1;
+// Make free_blks cover the whole disk, which takes loading the FAT blocks
+// that were never accessed. Return -1 if one of them cannot be read.
+static int fat_scan_all(struct fs *fs) {
+    if (fs->fat_all_scanned) {
+        return 0;
     }
 
-    // Read FAT
-    fat_entries = calloc(super_blk.fat_blk_num * BLOCK_SIZE, sizeof(uint16_t));
-    for (size_t i = SUPER_BLK_IDX + 1; i < (size_t)super_blk.fat_blk_num + 1; i++) {
-        size_t offset = (i - SUPER_BLK_IDX - 1) * BLOCK_SIZE;
-        if (block_read(i, (void*)(fat_entries + offset)) == -1) {
-            return -1;
+    pthread_mutex_lock(&fs->fat_lock);
+    int ret = 0;
+    for (size_t b = 0; b < fs->super_blk.fat_blk_num && ret == 0; b++) {
+        if (!bitmap_test(&fs->fat_scanned, b) && fat_load(fs, b) == NULL) {
+            ret = -1;
         }
     }
+    fs->fat_all_scanned = ret == 0;
+    pthread_mutex_unlock(&fs->fat_lock);
 
-    // Read Root directory
-    if (block_read(super_blk.rdir_idx, (void*)rt_dirt) == -1) {
-        return -1;
+    return ret;
+}
+
+// Return the FAT entry idx, or FAT_EOC if its block cannot be read
+static uint16_t fat_get(struct fs *fs, uint16_t idx) {
+    if (!fs->fat_lazy) {
+        return fs->fat_entries[idx];
     }
 
-    is_mount = 1;
-    ini_fdt(opened_fd);
+    pthread_mutex_lock(&fs->fat_lock);
+    uint16_t *blk = fat_load(fs, idx / FAT_PER_BLK);
+    uint16_t val = blk ? blk[idx % FAT_PER_BLK] : FAT_EOC;
+    pthread_mutex_unlock(&fs->fat_lock);
 
-    return 0;
+    return val;
 }
 
-int fs_umount(void)
-{
-	/* TODO: Phase 1 */
-    // Check is there a FS mounted.
-    if (!is_mount) {
-        return -1;
-    }
+// Update a FAT entry and remember which FAT block must be written back.
+// Return -1 if the FAT block cannot be read.
+static int fat_set(struct fs *fs, uint16_t idx, uint16_t val) {
+    size_t b = idx / FAT_PER_BLK;
 
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (opened_fd[i].seat != 0) {
-            return -1;
-        }
+    if (!fs->fat_lazy) {
+        fs->fat_entries[idx] = val;
+        bitmap_set(&fs->fat_dirty, b);
+        return 0;
     }
 
-    for (size_t i = SUPER_BLK_IDX + 1; i < (size_t)super_blk.fat_blk_num + 1; i++) {
-        size_t offset = (i - SUPER_BLK_IDX - 1) * BLOCK_SIZE;
-        if (block_write(i, (void*)(fat_entries + offset)) == -1) {
-            return -1;
-        }
+    pthread_mutex_lock(&fs->fat_lock);
+    uint16_t *blk = fat_load(fs, b);
+    if (blk != NULL) {
+        blk[idx % FAT_PER_BLK] = val;
+        bitmap_set(&fs->fat_dirty, b);
     }
+    pthread_mutex_unlock(&fs->fat_lock);
 
-    if (block_write(super_blk.rdir_idx, (void*)rt_dirt) == -1) {
-        return -1;
-    }
+    return blk ? 0 : -1;
+}
 
-    block_write(0, &super_blk);
+// Contents of FAT block b, which must be loaded
+static void *fat_block(struct fs *fs, size_t b) {
+    return fs->fat_lazy ? (void *)fs->fat_blks[b] : (char *)fs->fat_entries + b * BLOCK_SIZE;
+}
 
-    if (block_disk_close() == -1) {
-        return -1;
-    }
-    free(fat_entries);
-    is_mount = 0;
-    return 0;
+static void map_reset(struct fs *fs, int root_idx) {
+    free(fs->file_maps[root_idx].blks);
+    fs->file_maps[root_idx].blks = NULL;
+    fs->file_maps[root_idx].len = 0;
+    fs->file_maps[root_idx].cap = 0;
 }
 
-int fs_info(void)
-{
-	/* TODO: Phase 1 */
-    if (!is_mount) {
-        return -1;
+// FNV-1a hash of a file name, which is not NULL-terminated when it takes the
+// whole entry
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < FS_FILENAME_LEN && name[i] != '\0'; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
     }
+    return h & (NAME_BUCKETS - 1);
+}
 
-    int fat_free = 0;
-    int rdir_free = 0;
-    printf("FS Info:\n");
-    printf("total_blk_count=%u\n", super_blk.total_blk_num);
-    printf("fat_blk_count=%u\n", super_blk.fat_blk_num);
-    printf("rdir_blk=%u\n", super_blk.rdir_idx);
-    printf("data_blk=%u\n", super_blk.data_idx);
-    printf("data_blk_count=%u\n", super_blk.data_block_num);
+static void name_index_add(struct fs *fs, int slot) {
+    uint32_t h = name_hash(fs->rt_dirt[slot].file_name);
+    fs->name_next[slot] = fs->name_buckets[h];
+    fs->name_buckets[h] = slot;
+    bitmap_clear(&fs->free_slots, slot);
+}
 
-    for (int i = 1; i < super_blk.data_block_num; i++) {
-        if (fat_entries[i] == 0) {
-            fat_free++;
-        }
+static void name_index_remove(struct fs *fs, int slot) {
+    int *p = &fs->name_buckets[name_hash(fs->rt_dirt[slot].file_name)];
+    while (*p != slot) {
+        p = &fs->name_next[*p];
     }
-    printf("fat_free_ratio=%u/%u\n", fat_free, super_blk.data_block_num);
+    *p = fs->name_next[slot];
+    bitmap_set(&fs->free_slots, slot);
+}
 
-    for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
-        struct root cur_entry = rt_dirt[j];
-        if (cur_entry.file_name[0] == '\0') {
-            rdir_free++;
+// Slot of the file called name, or NO_SLOT
+static int file_exist(struct fs *fs, const char *name) {
+    if (name[0] == '\0' || strlen(name) >= FS_FILENAME_LEN) {
+        return NO_SLOT;
+    }
+    for (int i = fs->name_buckets[name_hash(name)]; i != NO_SLOT; i = fs->name_next[i]) {
+        if (strncmp(name, fs->rt_dirt[i].file_name, FS_FILENAME_LEN) == 0) {
+            return i;
         }
     }
-    printf("rdir_free_ratio=%d/%d\n", rdir_free, FS_FILE_MAX_COUNT);
-
-    return 0;
-
+    return NO_SLOT;
 }
 
-int fs_create(const char *filename)
-{
-    /* TODO: Phase 2 */
-    if (!is_mount || filename == NULL || strlen(filename) > FS_FILENAME_LEN) {
+// Index every file of the root directory
+static int name_index_build(struct fs *fs) {
+    if (bitmap_init(&fs->free_slots, FS_FILE_MAX_COUNT) == -1) {
         return -1;
     }
-
-    // Check if file already exists
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(rt_dirt[i].file_name, filename) == 0) {
-            return -1;
-        }
+    for (int i = 0; i < NAME_BUCKETS; i++) {
+        fs->name_buckets[i] = NO_SLOT;
     }
-    // Find an empty slot in the root directory.
     for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (rt_dirt[i].file_name[0] == '\0') {
-            memcpy(rt_dirt[i].file_name, (void*)filename,  FS_FILENAME_LEN);
-            rt_dirt[i].file_size = 0;
-            rt_dirt[i].first_data_idx = FAT_EOC;
-            // You may need to write changes to the disk here.
-
-            return 0;
+        bitmap_set(&fs->free_slots, i);
+        if (fs->rt_dirt[i].file_name[0] != '\0') {
+            name_index_add(fs, i);
         }
     }
-
-    // If we reach here, the root directory is full.
-    return -1;
+    return 0;
 }
 
-int fs_delete(const char *filename)
-{
-    /* TODO: Phase 2 */
-    if (!is_mount) {
-        return -1;
-    }
+// List the FAT blocks set in fat_bits, and the root directory if rdir is set
+static size_t collect_metadata(struct fs *fs, const struct bitmap *fat_bits, int rdir, size_t *blocks, const void **bufs) {
+    size_t n = 0;
 
-    // Check if the filename is valid
-    if (filename == NULL || strlen(filename) > FS_FILENAME_LEN) {
-        return -1;
+    for (size_t i = bitmap_find(fat_bits, 0); i != BITMAP_NONE; i = bitmap_find(fat_bits, i + 1)) {
+        blocks[n] = SUPER_BLK_IDX + 1 + i;
+        bufs[n] = fat_block(fs, i);
+        n++;
+    }
+    if (rdir) {
+        blocks[n] = fs->super_blk.rdir_idx;
+        bufs[n] = fs->rt_dirt;
+        n++;
     }
+    return n;
+}
 
-    // Check if the file is currently open
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (opened_fd[i].seat != 0 && strcmp(rt_dirt[opened_fd[i].root_idx].file_name, filename) == 0) {
-            // File is currently open
-            return -1;
+// Move the flags of fat_bits and *rdir to to_bits and *to_rdir, or only
+// clear them if to_bits is NULL
+static void move_metadata_bits(struct bitmap *fat_bits, int *rdir, struct bitmap *to_bits, int *to_rdir) {
+    for (size_t i = bitmap_find(fat_bits, 0); i != BITMAP_NONE; i = bitmap_find(fat_bits, i + 1)) {
+        bitmap_clear(fat_bits, i);
+        if (to_bits != NULL) {
+            bitmap_set(to_bits, i);
         }
     }
+    if (to_rdir != NULL) {
+        *to_rdir |= *rdir;
+    }
+    *rdir = 0;
+}
 
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp(rt_dirt[i].file_name, filename) == 0) {
-            // Found the file. Now remove it.
-            uint16_t curr = rt_dirt[i].first_data_idx;
-            while (fat_entries[curr] != FAT_EOC) {
-                uint16_t next = fat_entries[curr];
-                fat_entries[curr] = 0; // Free the block
-                curr = next;
-            }
-            fat_entries[curr] = 0;
-            memset(&rt_dirt[i], 0, sizeof(rt_dirt[i])); // Clear the directory
+// Write the FAT blocks set in fat_bits and the root directory if *rdir is set
+// to their home location, then clear the flags
+static int write_metadata(struct fs *fs, struct bitmap *fat_bits, int *rdir) {
+    size_t blocks[UINT8_MAX + 1];
+    const void *bufs[UINT8_MAX + 1];
+    size_t n = collect_metadata(fs, fat_bits, *rdir, blocks, bufs);
 
-            return 0;
-        }
+    if (disk_writev(fs->disk, blocks, bufs, n) == -1) {
+        return -1;
     }
+    move_metadata_bits(fat_bits, rdir, NULL, NULL);
 
-    // If we reach here, the file does not exist.
-    return -1;
+    return 0;
 }
 
-int fs_ls(void)
-{
-    /* TODO: Phase 2 */
-    if (!is_mount) {
+// Write every logged block home and empty the journal. The in-memory metadata
+// must not hold uncommitted changes.
+static int checkpoint(struct fs *fs) {
+    if (write_metadata(fs, &fs->fat_logged, &fs->rdir_logged) == -1) {
+        return -1;
+    }
+    if (disk_sync(fs->disk) == -1) {
         return -1;
     }
 
-    printf("FS Ls:\n");
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (rt_dirt[i].file_name[0] != '\0') {
-            printf("file: %s, size: %u, data_blk: %u\n", rt_dirt[i].file_name, rt_dirt[i].file_size, rt_dirt[i].first_data_idx);
-        }
+    // Flushed along with the next transaction; until then replaying the old
+    // transactions again is harmless
+    journal_reset(&fs->jrnl);
+    fs->super_blk.jrnl_seq = fs->jrnl.seq;
+    return disk_write(fs->disk, SUPER_BLK_IDX, &fs->super_blk);
+}
+
+// Commit the metadata changes made since the last commit as one transaction.
+// Every change made in the meantime joins the same group.
+static int commit_metadata(struct fs *fs) {
+    size_t blocks[UINT8_MAX + 1];
+    const void *bufs[UINT8_MAX + 1];
+    size_t n = collect_metadata(fs, &fs->fat_dirty, fs->rdir_dirty, blocks, bufs);
+
+    if (n == 0) {
+        return disk_sync(fs->disk);
+    }
+    if (journal_commit(&fs->jrnl, blocks, bufs, n) == -1) {
+        return -1;
+    }
+    move_metadata_bits(&fs->fat_dirty, &fs->rdir_dirty, &fs->fat_logged, &fs->rdir_logged);
+    for (size_t i = bitmap_find(&fs->freed_blks, 0); i != BITMAP_NONE; i = bitmap_find(&fs->freed_blks, i + 1)) {
+        bitmap_clear(&fs->freed_blks, i);
+        bitmap_set(&fs->free_blks, i);
     }
 
+    // Always keep room for a transaction covering all the metadata
+    if (journal_space(&fs->jrnl) < (size_t)fs->super_blk.fat_blk_num + 1) {
+        return checkpoint(fs);
+    }
     return 0;
 }
-int file_exist(const char *name) {
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (strcmp(name, (char *)rt_dirt[i].file_name) == 0) {
-            return i;
-        }
+
+// Apply the committed transactions of the journal declared in the superblock
+static int replay_journal(struct fs *fs) {
+    if (fs->super_blk.jrnl_blk_num < 2 || fs->super_blk.jrnl_start + fs->super_blk.jrnl_blk_num > fs->super_blk.total_blk_num) {
+        return -1;
     }
-    return -1;
-}
 
-int fs_open(const char *filename)
-{
-	/* TODO: Phase 3 */
-    int file_root_idx = 0;
-    if (!is_mount) {
+    journal_init(&fs->jrnl, fs->disk, fs->super_blk.jrnl_start, fs->super_blk.jrnl_blk_num, fs->super_blk.jrnl_seq);
+    int n = journal_replay(&fs->jrnl);
+    if (n == -1) {
         return -1;
     }
+    if (n == 0) {
+        return 0;
+    }
 
-    if (filename == NULL) {
+    // The replayed blocks must be durable before the transactions are dropped
+    if (disk_sync(fs->disk) == -1) {
         return -1;
     }
+    journal_reset(&fs->jrnl);
+    fs->super_blk.jrnl_seq = fs->jrnl.seq;
+    return disk_write(fs->disk, SUPER_BLK_IDX, &fs->super_blk);
+}
 
-    file_root_idx = file_exist(filename);
-    if (file_root_idx == -1) {
+// Carve a journal region out of the data blocks, at their end if possible, and
+// declare it in the superblock
+static int create_journal(struct fs *fs) {
+    size_t n = 2 * ((size_t)fs->super_blk.fat_blk_num + 2);
+    if (n < JRNL_MIN_BLKS) {
+        n = JRNL_MIN_BLKS;
+    }
+    if (n >= fs->super_blk.data_block_num) {
         return -1;
     }
 
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (opened_fd[i].seat == 0) {
-            opened_fd[i].seat = 1;
-            opened_fd[i].root_idx = file_root_idx;
-            opened_fd[i].offset = 0;
-            opened_fd[i].cur_data_blk = 0;
-            return i;
+    if (fat_scan_all(fs) == -1) {
+        return -1;
+    }
+    size_t first = fs->super_blk.data_block_num - n;
+    if (bitmap_find_run(&fs->free_blks, first, n) != first) {
+        first = bitmap_find_run(&fs->free_blks, 1, n);
+        if (first == BITMAP_NONE) {
+            return -1;
         }
     }
 
-    return -1;
-}
+    // Chain the region in the FAT so that it is never allocated to a file
+    for (size_t i = first; i < first + n; i++) {
+        bitmap_clear(&fs->free_blks, i);
+        fat_set(fs, i, i + 1 < first + n ? i + 1 : FAT_EOC);
+    }
 
-int fs_close(int fd)
-{
-	/* TODO: Phase 3 */
-    if (!is_mount) {
+    // Make sure no stale data is mistaken for a transaction
+    char zero[BLOCK_SIZE] = {0};
+    if (disk_write(fs->disk, fs->super_blk.data_idx + first, zero) == -1) {
         return -1;
     }
 
-    if (fd >= FS_OPEN_MAX_COUNT || fd < 0) {
+    // The region must be allocated on disk before it gets declared
+    if (write_metadata(fs, &fs->fat_dirty, &fs->rdir_dirty) == -1 || disk_sync(fs->disk) == -1) {
         return -1;
     }
-
-    if (opened_fd[fd].seat == 0) {
+    fs->super_blk.jrnl_magic = JRNL_MAGIC;
+    fs->super_blk.jrnl_start = fs->super_blk.data_idx + first;
+    fs->super_blk.jrnl_blk_num = n;
+    fs->super_blk.jrnl_seq = 1;
+    if (disk_write(fs->disk, SUPER_BLK_IDX, &fs->super_blk) == -1 || disk_sync(fs->disk) == -1) {
         return -1;
     }
 
-    opened_fd[fd].seat = 0;
+    journal_init(&fs->jrnl, fs->disk, fs->super_blk.jrnl_start, fs->super_blk.jrnl_blk_num, fs->super_blk.jrnl_seq);
+    fs->journaled = 1;
     return 0;
 }
 
-int fs_stat(int fd)
-{
-	/* TODO: Phase 3 */
-    if (!is_mount) {
-        return -1;
+// Allocate an instance with nothing mounted yet
+static struct fs *new_fs(size_t cache_blocks) {
+    struct fs *fs = calloc(1, sizeof(*fs));
+    if (fs == NULL) {
+        return NULL;
+    }
+    fs->rt_dirt = fs->rt_local;
+    fs->alloc_rotor = 1;
+    fs->cache_blocks = cache_blocks;
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&fs->fs_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        pthread_rwlock_init(&fs->file_locks[i], NULL);
+        pthread_mutex_init(&fs->file_maps[i].lock, NULL);
     }
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        pthread_mutex_init(&fs->opened_fd[i].lock, NULL);
+    }
+    pthread_mutex_init(&fs->fd_lock, NULL);
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->fat_lock, NULL);
+    pthread_mutex_init(&fs->sync_lock, NULL);
+    pthread_cond_init(&fs->sync_cond, NULL);
 
-    if (fd >= FS_OPEN_MAX_COUNT || fd < 0) {
-        return -1;
+    return fs;
+}
+
+// Release an instance, whether or not it got completely mounted. Nothing is
+// written back.
+static void free_fs(struct fs *fs) {
+    if (!fs->in_place) {
+        free(fs->fat_entries);
+    }
+    for (size_t i = 0; fs->fat_blks != NULL && i < fs->super_blk.fat_blk_num; i++) {
+        free(fs->fat_blks[i]);
+    }
+    free(fs->fat_blks);
+    bitmap_destroy(&fs->fat_scanned);
+    cache_destroy(fs->blk_cache);
+    if (fs->disk != NULL) {
+        disk_close(fs->disk);
     }
+    bitmap_destroy(&fs->free_blks);
+    bitmap_destroy(&fs->free_slots);
+    bitmap_destroy(&fs->fat_dirty);
+    bitmap_destroy(&fs->fat_logged);
+    bitmap_destroy(&fs->freed_blks);
 
-    if (opened_fd[fd].seat == 0) {
-        return -1;
+    pthread_rwlock_destroy(&fs->fs_lock);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        map_reset(fs, i);
+        pthread_rwlock_destroy(&fs->file_locks[i]);
+        pthread_mutex_destroy(&fs->file_maps[i].lock);
+    }
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        pthread_mutex_destroy(&fs->opened_fd[i].lock);
     }
+    pthread_mutex_destroy(&fs->fd_lock);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->fat_lock);
+    pthread_mutex_destroy(&fs->sync_lock);
+    pthread_cond_destroy(&fs->sync_cond);
+    free(fs);
+}
+
+static int mount_disk(struct fs *fs, const char *diskname, int flags);
 
-    uint32_t size = rt_dirt[opened_fd[fd].root_idx].file_size;
-    return size;
+struct fs *fsi_mount(const char *diskname, int flags, size_t cache_blocks)
+{
+    STATS_START(start);
+    STATS_ARGS(start, -1, flags, NULL);
+    struct fs *fs = new_fs(cache_blocks);
+    if (fs != NULL && mount_disk(fs, diskname, flags) == -1) {
+        free_fs(fs);
+        fs = NULL;
+    }
 
+    (void)STATS_RET(FS_STATS_MOUNT, start, fs ? 0 : -1);
+    return fs;
 }
 
-int fs_lseek(int fd, size_t offset)
+static int mount_disk(struct fs *fs, const char *diskname, int flags)
 {
-	/* TODO: Phase 3 */
-    if (!is_mount) {
+	/* TODO: Phase 1 */
+    int disk_flags = 0;
+
+    if (flags & FS_MOUNT_MMAP) {
+        disk_flags |= BLOCK_DISK_MMAP;
+    }
+    if (flags & FS_MOUNT_URING) {
+        disk_flags |= BLOCK_DISK_URING;
+    }
+
+    fs->disk = disk_open(diskname, disk_flags);
+    if (fs->disk == NULL) {
         return -1;
     }
 
-    if (fd >= FS_OPEN_MAX_COUNT || fd < 0) {
+    // Read Superblock
+    if(disk_read(fs->disk, SUPER_BLK_IDX, (void*)&fs->super_blk) == -1) {
         return -1;
     }
 
-    if (opened_fd[fd].seat == 0) {
+    if (memcmp(&fs->super_blk.signature, "ECS150FS", 8) != 0) {
         return -1;
     }
 
-    if (offset > (size_t) fs_stat(fd)) {
+    if (fs->super_blk.total_blk_num != disk_count(fs->disk)) {
         return -1;
     }
 
-    opened_fd[fd].offset = offset;
-    // Calculate the offset is in which block in the file
-    if (opened_fd[fd].offset >= BLOCK_SIZE) {
-        opened_fd[fd].cur_data_blk = opened_fd[fd].offset / BLOCK_SIZE;
+    // Bring the metadata up to date before loading it
+    fs->journaled = fs->super_blk.jrnl_magic == JRNL_MAGIC;
+    if (fs->journaled && replay_journal(fs) == -1) {
+        return -1;
     }
 
-    return 0;
-}
-// Return the data blk idx of offset currently in
-int get_data_blk_idx(int fd) {
-    int blk_num = opened_fd[fd].cur_data_blk;
-    int blk_idx = 0;
-    int first_blk_idx = rt_dirt[opened_fd[fd].root_idx].first_data_idx;
-    if (blk_num == 0) {
-        return first_blk_idx + super_blk.fat_blk_num + 2;
+    // Journaled metadata must only reach its home location at checkpoints
+    fs->in_place = (flags & FS_MOUNT_MMAP) && !fs->journaled && !(flags & FS_MOUNT_JOURNAL);
+    if (fs->in_place) {
+        // Use the FAT and the root directory straight from the mapping
+        fs->fat_entries = disk_map(fs->disk, SUPER_BLK_IDX + 1);
+        fs->rt_dirt = disk_map(fs->disk, fs->super_blk.rdir_idx);
+        if (fs->fat_entries == NULL || fs->rt_dirt == NULL) {
+            fs->rt_dirt = fs->rt_local;
+            return -1;
+        }
+    } else if (flags & FS_MOUNT_LAZY) {
+        // FAT blocks are read on first access
+        fs->fat_lazy = 1;
+        fs->fat_blks = calloc(fs->super_blk.fat_blk_num, sizeof(uint16_t *));
+        if (fs->fat_blks == NULL || bitmap_init(&fs->fat_scanned, fs->super_blk.fat_blk_num) == -1) {
+            return -1;
+        }
+
+        // Read Root directory
+        fs->rt_dirt = fs->rt_local;
+        if (disk_read(fs->disk, fs->super_blk.rdir_idx, (void*)fs->rt_dirt) == -1) {
+            return -1;
+        }
     } else {
-        for (int i = 0; i < blk_num; i++) {
-            blk_idx = fat_entries[first_blk_idx];
-            first_blk_idx = blk_idx;
+        // Read FAT, all blocks in one go
+        fs->fat_entries = malloc(fs->super_blk.fat_blk_num * BLOCK_SIZE);
+        if (fs->fat_entries == NULL || disk_read_range(fs->disk, SUPER_BLK_IDX + 1, fs->super_blk.fat_blk_num, (void*)fs->fat_entries) == -1) {
+            return -1;
+        }
+
+        // Read Root directory
+        fs->rt_dirt = fs->rt_local;
+        if (disk_read(fs->disk, fs->super_blk.rdir_idx, (void*)fs->rt_dirt) == -1) {
+            return -1;
         }
     }
-    blk_idx += super_blk.fat_blk_num + 2;
-    return blk_idx;
-}
 
-int fs_write(int fd, void *buf, size_t count)
-{
-	/* TODO: Phase 4 */
-    if (!is_mount) {
+    if (name_index_build(fs) == -1) {
         return -1;
     }
 
-    if (fd >= FS_OPEN_MAX_COUNT || fd < 0) {
+    if (bitmap_init(&fs->fat_dirty, fs->super_blk.fat_blk_num) == -1) {
         return -1;
     }
-
-    if (opened_fd[fd].seat == 0) {
+    fs->rdir_dirty = 0;
+    if (bitmap_init(&fs->fat_logged, fs->super_blk.fat_blk_num) == -1) {
         return -1;
     }
-
-    if (buf == NULL) {
+    fs->rdir_logged = 0;
+    if (bitmap_init(&fs->freed_blks, fs->super_blk.data_block_num) == -1) {
         return -1;
     }
 
-    size_t remaining = count;
-    uint write_size = 0;
-    size_t buf_pos = 0;
+    // Free-space bitmap, kept in sync with the FAT from now on
+    if (bitmap_init(&fs->free_blks, fs->super_blk.data_block_num) == -1) {
+        return -1;
+    }
+    for (size_t i = 1; !fs->fat_lazy && i < fs->super_blk.data_block_num; i++) {
+        if (fs->fat_entries[i] == 0) {
+            bitmap_set(&fs->free_blks, i);
+        }
+    }
+    fs->fat_all_scanned = !fs->fat_lazy;
+    fs->alloc_rotor = 1;
 
-    while (remaining > 0) {
-        int data_blk_idx = get_data_blk_idx(fd);
-        char *bounce = (char *) calloc(BLOCK_SIZE, sizeof(char));
-        int cur_offset = opened_fd[fd].offset;
-        size_t offset_in_blk = cur_offset % BLOCK_SIZE;
-        size_t cost = 0;
-        size_t free_idx = 0;
+    if ((flags & FS_MOUNT_JOURNAL) && !fs->journaled && create_journal(fs) == -1) {
+        return -1;
+    }
 
-        if (BLOCK_SIZE - offset_in_blk > remaining) {
-            cost = remaining;
-        } else {
-            cost = BLOCK_SIZE - offset_in_blk;
-        }
+    // Data blocks go through the write-back cache, which would only add a
+    // copy on top of a mapped disk
+    fs->blk_cache = cache_create(fs->disk, fs->in_place ? 0 : fs->cache_blocks);
+    if (fs->blk_cache == NULL) {
+        return -1;
+    }
 
-        if (block_read(data_blk_idx, (void *)bounce) == -1) {
-            free(bounce);
-            return -1;
-        }
+    ini_fdt(fs->opened_fd);
 
-        memcpy(bounce + cur_offset % BLOCK_SIZE, (char *)(buf + buf_pos), cost);
-        block_write(data_blk_idx, (void *)bounce);
-        buf_pos += cost;
-        remaining -= cost;
-        write_size += cost;
-        cur_offset += cost;
+    return 0;
+}
 
-        if (remaining > 0 && (uint32_t)cur_offset >= rt_dirt[opened_fd[fd].root_idx].file_size) {
-            // Find free index
-            for (int i = 1; i < super_blk.data_block_num; i++) {
-                if (fat_entries[i] == 0) {
-                    free_idx = i;
-                    break;
-                }
+static int sync_locked(struct fs *fs);
+static int umount_locked(struct fs *fs);
 
-                if (i == super_blk.data_block_num - 1) {
-                    return -1;
-                }
-            }
+int fsi_umount(struct fs *fs)
+{
+    STATS_START(start);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = umount_locked(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
 
-            // Allocate new block
-            fat_entries[data_blk_idx] = free_idx;
-            fat_entries[free_idx] = FAT_EOC;
-        }
-        rt_dirt[opened_fd[fd].root_idx].file_size += cost;
-        fs_lseek(fd, cur_offset);
-        free(bounce);
+    if (ret == 0) {
+        free_fs(fs);
     }
-
-    return write_size;
+    return STATS_RET(FS_STATS_UMOUNT, start, ret);
 }
 
-int fs_read(int fd, void *buf, size_t count)
+static int umount_locked(struct fs *fs)
 {
-	/* TODO: Phase 4 */
-    if (!is_mount) {
-        return -1;
+	/* TODO: Phase 1 */
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->opened_fd[i].seat != 0) {
+            return -1;
+        }
     }
 
-    if (fd >= FS_OPEN_MAX_COUNT || fd < 0) {
+    if (sync_locked(fs) == -1) {
         return -1;
     }
-
-    if (opened_fd[fd].seat == 0) {
+    // Leave the metadata complete at its home location
+    if (fs->journaled && checkpoint(fs) == -1) {
         return -1;
     }
 
-    if (buf == NULL) {
+    return 0;
+}
+
+int fsi_fat_budget(struct fs *fs, size_t nblocks)
+{
+    if (!fs->fat_lazy) {
         return -1;
     }
 
-    size_t remaining = count;
-    uint read_size = 0;
-    size_t buf_pos = 0;
+    pthread_mutex_lock(&fs->fat_lock);
+    fs->fat_budget = nblocks;
+    pthread_mutex_unlock(&fs->fat_lock);
 
-    while (remaining > 0) {
-        int data_blk_idx = get_data_blk_idx(fd);
-        char *bounce = (char *) calloc(BLOCK_SIZE, sizeof(char));
-        int cur_offset = opened_fd[fd].offset;
-        size_t offset_in_blk = cur_offset % BLOCK_SIZE;
-        size_t cost = 0;
+    return 0;
+}
 
+int fsi_flush(struct fs *fs)
+{
+    STATS_START(start);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = 0;
+    if (cache_flush(fs->blk_cache) == -1) {
+        ret = -1;
+    } else if (fs->in_place) {
+        // A mapped disk also holds the FAT and root directory changes
+        ret = disk_sync(fs->disk);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
 
-        if (BLOCK_SIZE - offset_in_blk > remaining) {
-            cost = remaining;
-        } else {
+    return STATS_RET(FS_STATS_FLUSH, start, ret);
+}
+
+int fsi_sync(struct fs *fs)
+{
+    STATS_START(start);
+    pthread_mutex_lock(&fs->sync_lock);
+
+    // A sync already running may have missed the changes of the caller, so
+    // wait for the next one. It covers every caller that waited meanwhile.
+    unsigned long target = fs->sync_gen + (fs->sync_running ? 2 : 1);
+    while (fs->sync_gen < target) {
+        if (fs->sync_running) {
+            pthread_cond_wait(&fs->sync_cond, &fs->sync_lock);
+            continue;
+        }
+        fs->sync_running = 1;
+        pthread_mutex_unlock(&fs->sync_lock);
+
+        pthread_rwlock_wrlock(&fs->fs_lock);
+        int ret = sync_locked(fs);
+        pthread_rwlock_unlock(&fs->fs_lock);
+
+        pthread_mutex_lock(&fs->sync_lock);
+        fs->sync_ret = ret;
+        fs->sync_gen++;
+        fs->sync_running = 0;
+        pthread_cond_broadcast(&fs->sync_cond);
+    }
+    int ret = fs->sync_ret;
+
+    pthread_mutex_unlock(&fs->sync_lock);
+    return STATS_RET(FS_STATS_SYNC, start, ret);
+}
+
+static int sync_locked(struct fs *fs)
+{
+    // Data blocks first, so the metadata never points to unwritten blocks
+    if (cache_flush(fs->blk_cache) == -1) {
+        return -1;
+    }
+
+    if (fs->journaled) {
+        return commit_metadata(fs);
+    }
+
+    // A mapped disk already holds the metadata changes
+    if (!fs->in_place && write_metadata(fs, &fs->fat_dirty, &fs->rdir_dirty) == -1) {
+        return -1;
+    }
+
+    return disk_sync(fs->disk);
+}
+
+#ifdef FS_STATS
+// Fill amp with the counters of file root_idx, or of the whole instance for
+// NO_SLOT
+static void amp_get(struct fs *fs, int root_idx, struct fs_amp *amp) {
+    const uint64_t *src = (const uint64_t *)(root_idx == NO_SLOT ? &fs->amp : &fs->file_amp[root_idx]);
+    uint64_t *dst = (uint64_t *)amp;
+
+    for (size_t i = 0; i < sizeof(*amp) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    if (root_idx == NO_SLOT) {
+        // Everything that went through the disk, metadata and write-back
+        // included
+        uint64_t reads, writes;
+        disk_io_stats(fs->disk, &reads, &writes);
+        amp->physical_read = reads * BLOCK_SIZE;
+        amp->physical_written = writes * BLOCK_SIZE;
+    }
+}
+#endif
+
+int fsi_amp(struct fs *fs, const char *filename, struct fs_amp *amp)
+{
+#ifdef FS_STATS
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    int root_idx = filename ? file_exist(fs, filename) : NO_SLOT;
+    if (filename == NULL || root_idx != NO_SLOT) {
+        amp_get(fs, root_idx, amp);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    return (filename && root_idx == NO_SLOT) ? -1 : 0;
+#else
+    (void)fs;
+    (void)filename;
+    (void)amp;
+    return -1;
+#endif
+}
+
+static int info_locked(struct fs *fs);
+
+int fsi_info(struct fs *fs)
+{
+    STATS_START(start);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = info_locked(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    return STATS_RET(FS_STATS_INFO, start, ret);
+}
+
+static int info_locked(struct fs *fs)
+{
+	/* TODO: Phase 1 */
+    if (fat_scan_all(fs) == -1) {
+        return -1;
+    }
+
+    int fat_free = bitmap_count(&fs->free_blks) + bitmap_count(&fs->freed_blks);
+    int rdir_free = bitmap_count(&fs->free_slots);
+    printf("FS Info:\n");
+    printf("total_blk_count=%u\n", fs->super_blk.total_blk_num);
+    printf("fat_blk_count=%u\n", fs->super_blk.fat_blk_num);
+    printf("rdir_blk=%u\n", fs->super_blk.rdir_idx);
+    printf("data_blk=%u\n", fs->super_blk.data_idx);
+    printf("data_blk_count=%u\n", fs->super_blk.data_block_num);
+
+    printf("fat_free_ratio=%u/%u\n", fat_free, fs->super_blk.data_block_num);
+
+    printf("rdir_free_ratio=%d/%d\n", rdir_free, FS_FILE_MAX_COUNT);
+
+    size_t ra_issued, ra_hits;
+    cache_ra_stats(fs->blk_cache, &ra_issued, &ra_hits);
+    printf("readahead_hit_ratio=%zu/%zu\n", ra_hits, ra_issued);
+
+#ifdef FS_STATS
+    // Device bytes per application byte since mount
+    struct fs_amp amp;
+    amp_get(fs, NO_SLOT, &amp);
+    printf("read_amplification=%.2f\n", amp.logical_read ? (double)amp.physical_read / amp.logical_read : 0);
+    printf("write_amplification=%.2f\n", amp.logical_written ? (double)amp.physical_written / amp.logical_written : 0);
+#endif
+
+    return 0;
+
+}
+
+static int create_locked(struct fs *fs, const char *filename);
+
+int fsi_create(struct fs *fs, const char *filename)
+{
+    STATS_START(start);
+    STATS_ARGS(start, -1, 0, filename);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = create_locked(fs, filename);
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    return STATS_RET(FS_STATS_CREATE, start, ret);
+}
+
+static int create_locked(struct fs *fs, const char *filename)
+{
+    /* TODO: Phase 2 */
+    // The name must fit in an entry with its NULL terminator
+    if (filename == NULL || filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN) {
+        return -1;
+    }
+
+    // Check if file already exists
+    if (file_exist(fs, filename) != NO_SLOT) {
+        return -1;
+    }
+
+    // Take the first empty slot in the root directory, if it is not full
+    size_t i = bitmap_find(&fs->free_slots, 0);
+    if (i == BITMAP_NONE) {
+        return -1;
+    }
+    memset(&fs->rt_dirt[i], 0, sizeof(fs->rt_dirt[i]));
+    strcpy(fs->rt_dirt[i].file_name, filename);
+    fs->rt_dirt[i].file_size = 0;
+    fs->rt_dirt[i].first_data_idx = FAT_EOC;
+    name_index_add(fs, i);
+    fs->rdir_dirty = 1;
+    memset(&fs->file_amp[i], 0, sizeof(fs->file_amp[i]));
+
+    return 0;
+}
+
+static int delete_locked(struct fs *fs, const char *filename);
+
+int fsi_delete(struct fs *fs, const char *filename)
+{
+    STATS_START(start);
+    STATS_ARGS(start, -1, 0, filename);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = delete_locked(fs, filename);
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    return STATS_RET(FS_STATS_DELETE, start, ret);
+}
+
+static int delete_locked(struct fs *fs, const char *filename)
+{
+    /* TODO: Phase 2 */
+    // Check if the filename is valid
+    if (filename == NULL) {
+        return -1;
+    }
+
+    int i = file_exist(fs, filename);
+    if (i == NO_SLOT) {
+        return -1;
+    }
+
+    // Check if the file is currently open
+    for (int j = 0; j < FS_OPEN_MAX_COUNT; j++) {
+        if (fs->opened_fd[j].seat != 0 && fs->opened_fd[j].root_idx == i) {
+            return -1;
+        }
+    }
+
+    // Empty files own no data block
+    uint16_t curr = fs->rt_dirt[i].first_data_idx;
+    while (curr != FAT_EOC) {
+        uint16_t next = fat_get(fs, curr);
+        if (fat_set(fs, curr, 0) == -1) { // Free the block
+            return -1;
+        }
+        bitmap_set(fs->journaled ? &fs->freed_blks : &fs->free_blks, curr);
+        curr = next;
+    }
+    name_index_remove(fs, i);
+    memset(&fs->rt_dirt[i], 0, sizeof(fs->rt_dirt[i])); // Clear the directory
+    fs->rdir_dirty = 1;
+    map_reset(fs, i);
+
+    return 0;
+}
+
+static int ls_locked(struct fs *fs);
+
+int fsi_ls(struct fs *fs)
+{
+    STATS_START(start);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = ls_locked(fs);
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    return STATS_RET(FS_STATS_LS, start, ret);
+}
+
+static int ls_locked(struct fs *fs)
+{
+    /* TODO: Phase 2 */
+    printf("FS Ls:\n");
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (fs->rt_dirt[i].file_name[0] != '\0') {
+            printf("file: %s, size: %u, data_blk: %u\n", fs->rt_dirt[i].file_name, fs->rt_dirt[i].file_size, fs->rt_dirt[i].first_data_idx);
+        }
+    }
+
+    return 0;
+}
+
+int fsi_list(struct fs *fs, char names[][FS_FILENAME_LEN])
+{
+    STATS_START(start);
+    if (names == NULL) {
+        return STATS_RET(FS_STATS_LS, start, -1);
+    }
+
+    // Names only change under the exclusive lock
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    int n = 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (fs->rt_dirt[i].file_name[0] != '\0') {
+            memcpy(names[n], fs->rt_dirt[i].file_name, FS_FILENAME_LEN);
+            names[n++][FS_FILENAME_LEN - 1] = '\0';
+        }
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    return STATS_RET(FS_STATS_LS, start, n);
+}
+
+int fsi_open(struct fs *fs, const char *filename)
+{
+    STATS_START(start);
+    STATS_ARGS(start, -1, 0, filename);
+	/* TODO: Phase 3 */
+    int file_root_idx = 0;
+
+    if (filename == NULL) {
+        return STATS_RET(FS_STATS_OPEN, start, -1);
+    }
+
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    file_root_idx = file_exist(fs, filename);
+    if (file_root_idx == NO_SLOT) {
+        pthread_rwlock_unlock(&fs->fs_lock);
+        return STATS_RET(FS_STATS_OPEN, start, -1);
+    }
+
+    int fd = -1;
+    pthread_mutex_lock(&fs->fd_lock);
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->opened_fd[i].seat == 0) {
+            fs->opened_fd[i].seat = 1;
+            fs->opened_fd[i].root_idx = file_root_idx;
+            fs->opened_fd[i].offset = 0;
+            fs->opened_fd[i].ra_last_end = 0;
+            fs->opened_fd[i].ra_window = 0;
+            fs->opened_fd[i].ra_end = 0;
+            fd = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    return STATS_RET(FS_STATS_OPEN, start, fd);
+}
+
+// Lock fd for an operation, along with its file, exclusively if write is set.
+// Return -1 if fd is not open.
+static int fd_acquire(struct fs *fs, int fd, int write) {
+    if (fd >= FS_OPEN_MAX_COUNT || fd < 0) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&fs->fs_lock);
+    pthread_mutex_lock(&fs->opened_fd[fd].lock);
+    if (fs->opened_fd[fd].seat == 0) {
+        pthread_mutex_unlock(&fs->opened_fd[fd].lock);
+        pthread_rwlock_unlock(&fs->fs_lock);
+        return -1;
+    }
+
+    if (write) {
+        pthread_rwlock_wrlock(&fs->file_locks[fs->opened_fd[fd].root_idx]);
+    } else {
+        pthread_rwlock_rdlock(&fs->file_locks[fs->opened_fd[fd].root_idx]);
+    }
+    return 0;
+}
+
+static void fd_release(struct fs *fs, int fd) {
+    pthread_rwlock_unlock(&fs->file_locks[fs->opened_fd[fd].root_idx]);
+    pthread_mutex_unlock(&fs->opened_fd[fd].lock);
+    pthread_rwlock_unlock(&fs->fs_lock);
+}
+
+// Lock the file open as fd like fd_acquire(fs), without keeping the fd, so
+// that threads sharing fd are not serialized. Return the root index of the
+// file, or -1 if fd is invalid.
+static int file_acquire(struct fs *fs, int fd, int write) {
+    if (fd_acquire(fs, fd, write) == -1) {
+        return -1;
+    }
+
+    int root_idx = fs->opened_fd[fd].root_idx;
+    pthread_mutex_unlock(&fs->opened_fd[fd].lock);
+    return root_idx;
+}
+
+static void file_release(struct fs *fs, int root_idx) {
+    pthread_rwlock_unlock(&fs->file_locks[root_idx]);
+    pthread_rwlock_unlock(&fs->fs_lock);
+}
+
+int fsi_close(struct fs *fs, int fd)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, 0, NULL);
+	/* TODO: Phase 3 */
+    // Exclusive, positional calls may still use the block map
+    if (fd_acquire(fs, fd, 1) == -1) {
+        return STATS_RET(FS_STATS_CLOSE, start, -1);
+    }
+
+    int root_idx = fs->opened_fd[fd].root_idx;
+    pthread_mutex_lock(&fs->fd_lock);
+    fs->opened_fd[fd].seat = 0;
+
+    // The block map lives as long as the file is open
+    int in_use = 0;
+    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        if (fs->opened_fd[i].seat != 0 && fs->opened_fd[i].root_idx == root_idx) {
+            in_use = 1;
+            break;
+        }
+    }
+    if (!in_use) {
+        map_reset(fs, root_idx);
+    }
+    pthread_mutex_unlock(&fs->fd_lock);
+
+    // The seat can already be taken by another file, do not use fd_release(fs)
+    pthread_rwlock_unlock(&fs->file_locks[root_idx]);
+    pthread_mutex_unlock(&fs->opened_fd[fd].lock);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return STATS_RET(FS_STATS_CLOSE, start, 0);
+}
+
+int fsi_stat(struct fs *fs, int fd)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, 0, NULL);
+	/* TODO: Phase 3 */
+    if (fd_acquire(fs, fd, 0) == -1) {
+        return STATS_RET(FS_STATS_STAT, start, -1);
+    }
+
+    uint32_t size = fs->rt_dirt[fs->opened_fd[fd].root_idx].file_size;
+
+    fd_release(fs, fd);
+    return STATS_RET(FS_STATS_STAT, start, size);
+
+}
+
+int fsi_lseek(struct fs *fs, int fd, size_t offset)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, offset, NULL);
+	/* TODO: Phase 3 */
+    if (fd_acquire(fs, fd, 0) == -1) {
+        return STATS_RET(FS_STATS_LSEEK, start, -1);
+    }
+
+    int ret = -1;
+    if (offset <= fs->rt_dirt[fs->opened_fd[fd].root_idx].file_size) {
+        fs->opened_fd[fd].offset = offset;
+        ret = 0;
+    }
+
+    fd_release(fs, fd);
+    return STATS_RET(FS_STATS_LSEEK, start, ret);
+}
+static uint16_t map_lookup(struct fs *fs, int root_idx, size_t n);
+
+// Return the FAT index of the n-th data block of a file. The chain is only
+// walked from the end of the block map, so repeated lookups cost O(1).
+static uint16_t file_blk(struct fs *fs, int root_idx, size_t n) {
+    struct blk_map *map = &fs->file_maps[root_idx];
+
+    pthread_mutex_lock(&map->lock);
+    uint16_t idx = map_lookup(fs, root_idx, n);
+    pthread_mutex_unlock(&map->lock);
+
+    return idx;
+}
+
+static uint16_t map_lookup(struct fs *fs, int root_idx, size_t n) {
+    struct blk_map *map = &fs->file_maps[root_idx];
+
+    if (n < map->len) {
+        return map->blks[n];
+    }
+
+    if (n >= map->cap) {
+        size_t cap = map->cap ? map->cap : 16;
+        while (cap <= n) {
+            cap *= 2;
+        }
+        uint16_t *blks = realloc(map->blks, cap * sizeof(uint16_t));
+        if (blks == NULL) {
+            // Out of memory, walk the chain without recording it
+            uint16_t idx = fs->rt_dirt[root_idx].first_data_idx;
+            for (size_t i = 0; i < n; i++) {
+                idx = fat_get(fs, idx);
+            }
+            STATS_ADD(stats.fat_hops, n);
+            return idx;
+        }
+        map->blks = blks;
+        map->cap = cap;
+    }
+
+    uint16_t idx = map->len ? fat_get(fs, map->blks[map->len - 1]) : fs->rt_dirt[root_idx].first_data_idx;
+    while (map->len <= n && idx != FAT_EOC) {
+        map->blks[map->len++] = idx;
+        idx = fat_get(fs, idx);
+        STATS_ADD(stats.fat_hops, 1);
+    }
+
+    return n < map->len ? map->blks[n] : FAT_EOC;
+}
+
+// Pick a free data block for a file whose last data block is last (FAT_EOC
+// for an empty file). Return BITMAP_NONE if the disk is full.
+static size_t pick_free_blk(struct fs *fs, uint16_t last) {
+    if (fat_scan_all(fs) == -1) {
+        return BITMAP_NONE;
+    }
+
+    // Keep the file contiguous whenever the next block is free
+    if (last != FAT_EOC && last + 1U < fs->super_blk.data_block_num && bitmap_test(&fs->free_blks, last + 1)) {
+        return last + 1;
+    }
+
+    // Otherwise start a new extent in a window of free blocks, past the
+    // windows given to the previous extents, so that files growing at the
+    // same time do not interleave block by block
+    size_t idx = bitmap_find_run(&fs->free_blks, fs->alloc_rotor, ALLOC_WINDOW);
+    if (idx == BITMAP_NONE) {
+        idx = bitmap_find_run(&fs->free_blks, 1, ALLOC_WINDOW);
+    }
+    if (idx != BITMAP_NONE) {
+        fs->alloc_rotor = idx + ALLOC_WINDOW;
+        return idx;
+    }
+
+    // Fragmented disk, take the closest free block
+    idx = bitmap_find(&fs->free_blks, last != FAT_EOC ? last + 1U : 1);
+    if (idx == BITMAP_NONE) {
+        idx = bitmap_find(&fs->free_blks, 1);
+    }
+    return idx;
+}
+
+// Link free data block idx after data block last of file root_idx (FAT_EOC to
+// make it the first block). alloc_lock must be held. Return -1 if a FAT block
+// cannot be read.
+static int link_data_blk(struct fs *fs, int root_idx, uint16_t last, uint16_t idx) {
+    struct root *entry = &fs->rt_dirt[root_idx];
+
+    if (fat_set(fs, idx, FAT_EOC) == -1) {
+        return -1;
+    }
+    bitmap_clear(&fs->free_blks, idx);
+    if (last == FAT_EOC) {
+        entry->first_data_idx = idx;
+        fs->rdir_dirty = 1;
+    } else if (fat_set(fs, last, idx) == -1) {
+        // Give the block back, the chain is unchanged
+        fat_set(fs, idx, 0);
+        bitmap_set(&fs->free_blks, idx);
+        return -1;
+    }
+
+    // Keep a block map that covers the whole chain complete
+    struct blk_map *map = &fs->file_maps[root_idx];
+    pthread_mutex_lock(&map->lock);
+    if (map->len < map->cap && (map->len ? map->blks[map->len - 1] == last : last == FAT_EOC)) {
+        map->blks[map->len++] = idx;
+    }
+    pthread_mutex_unlock(&map->lock);
+    return 0;
+}
+
+// Allocate a data block and link it after data block last of file root_idx.
+// Return the new data block index, or -1 if the disk is full or the FAT
+// cannot be read.
+static int alloc_data_blk(struct fs *fs, int root_idx, uint16_t last) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    size_t free_idx = pick_free_blk(fs, last);
+    if (free_idx != BITMAP_NONE && link_data_blk(fs, root_idx, last, free_idx) == -1) {
+        free_idx = BITMAP_NONE;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return free_idx == BITMAP_NONE ? -1 : (int)free_idx;
+}
+
+// Grow the size recorded in the directory entry of a file
+static void grow_file(struct fs *fs, struct root *entry, size_t size) {
+    if (size > entry->file_size) {
+        pthread_mutex_lock(&fs->alloc_lock);
+        entry->file_size = size;
+        fs->rdir_dirty = 1;
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+}
+
+static int reserve_locked(struct fs *fs, int fd, size_t bytes);
+
+int fsi_reserve(struct fs *fs, int fd, size_t bytes)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, bytes, NULL);
+    if (fd_acquire(fs, fd, 1) == -1) {
+        return STATS_RET(FS_STATS_RESERVE, start, -1);
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    int ret = reserve_locked(fs, fd, bytes);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    fd_release(fs, fd);
+    return STATS_RET(FS_STATS_RESERVE, start, ret);
+}
+
+static int reserve_locked(struct fs *fs, int fd, size_t bytes)
+{
+    int root_idx = fs->opened_fd[fd].root_idx;
+    size_t want = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t have = 0;
+    while (have < want && file_blk(fs, root_idx, have) != FAT_EOC) {
+        have++;
+    }
+    if (have == want) {
+        return 0;
+    }
+
+    size_t need = want - have;
+    if (fat_scan_all(fs) == -1 || need > bitmap_count(&fs->free_blks)) {
+        return -1;
+    }
+
+    // Prefer continuing the file, then a single run anywhere; without a run
+    // large enough, fall back to the regular allocator block by block
+    uint16_t last = have ? file_blk(fs, root_idx, have - 1) : FAT_EOC;
+    size_t start = BITMAP_NONE;
+    if (last != FAT_EOC && bitmap_find_run(&fs->free_blks, last + 1U, need) == last + 1U) {
+        start = last + 1U;
+    } else {
+        start = bitmap_find_run(&fs->free_blks, 1, need);
+    }
+
+    for (size_t i = 0; i < need; i++) {
+        uint16_t idx = (start != BITMAP_NONE) ? start + i : pick_free_blk(fs, last);
+        if (link_data_blk(fs, root_idx, last, idx) == -1) {
+            return -1;
+        }
+        last = idx;
+    }
+
+    return 0;
+}
+
+// Position in the user buffers of a read or write, a single buffer being a
+// one element vector
+struct iov_iter {
+    const struct iovec *iov;
+    int cnt;            // Buffers left, iov included
+    size_t pos;         // Bytes of iov already consumed
+};
+
+static void iter_init(struct iov_iter *it, const struct iovec *iov, int cnt) {
+    it->iov = iov;
+    it->cnt = cnt;
+    it->pos = 0;
+    // Skip empty buffers, so that iov is the one the next byte goes to
+    while (it->cnt > 0 && it->iov->iov_len == 0) {
+        it->iov++;
+        it->cnt--;
+    }
+}
+
+static void iter_advance(struct iov_iter *it, size_t len) {
+    while (len > 0 && it->cnt > 0) {
+        size_t n = it->iov->iov_len - it->pos;
+        if (n > len) {
+            it->pos += len;
+            return;
+        }
+        len -= n;
+        iter_init(it, it->iov + 1, it->cnt - 1);
+    }
+}
+
+// Return the next len bytes if they lie in a single buffer, NULL otherwise
+static char *iter_span(const struct iov_iter *it, size_t len) {
+    if (it->cnt == 0 || it->iov->iov_len - it->pos < len) {
+        return NULL;
+    }
+    return (char *)it->iov->iov_base + it->pos;
+}
+
+// Number of whole blocks, up to nblk, that follow one after the other in the
+// current buffer
+static size_t iter_blocks(const struct iov_iter *it, size_t nblk) {
+    size_t n = 0;
+    if (it->cnt > 0) {
+        n = (it->iov->iov_len - it->pos) / BLOCK_SIZE;
+    }
+    if (n > nblk) {
+        n = nblk;
+    }
+    return n > CACHE_SPAN_MAX ? CACHE_SPAN_MAX : n;
+}
+
+// Gather the next len bytes into dst
+static void iter_copy_out(struct iov_iter *it, char *dst, size_t len) {
+    while (len > 0 && it->cnt > 0) {
+        size_t n = it->iov->iov_len - it->pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(dst, (char *)it->iov->iov_base + it->pos, n);
+        dst += n;
+        len -= n;
+        iter_advance(it, n);
+    }
+}
+
+// Scatter len bytes of src to the next bytes of the buffers
+static void iter_copy_in(struct iov_iter *it, const char *src, size_t len) {
+    while (len > 0 && it->cnt > 0) {
+        size_t n = it->iov->iov_len - it->pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy((char *)it->iov->iov_base + it->pos, src, n);
+        src += n;
+        len -= n;
+        iter_advance(it, n);
+    }
+}
+
+// Total size of a vector of buffers, -1 if it is invalid
+static ssize_t iov_total(const struct iovec *iov, int cnt) {
+    size_t total = 0;
+
+    if (cnt < 0 || (cnt > 0 && iov == NULL)) {
+        return -1;
+    }
+    for (int i = 0; i < cnt; i++) {
+        if (iov[i].iov_base == NULL && iov[i].iov_len > 0) {
+            return -1;
+        }
+        total += iov[i].iov_len;
+    }
+    return total > INT32_MAX ? -1 : (ssize_t)total;
+}
+
+// Write nblk whole blocks at the block aligned offset of file root_idx
+// straight from the current buffer of it, which must hold them, extending the
+// file as needed. Return the number of bytes written (0 if the disk is full),
+// or -1 on I/O error.
+static int write_span(struct fs *fs, int root_idx, size_t offset, const struct iov_iter *it, size_t nblk) {
+    size_t first = offset / BLOCK_SIZE;
+    size_t blocks[CACHE_SPAN_MAX];
+    const void *bufs[CACHE_SPAN_MAX];
+    const char *buf = iter_span(it, nblk * BLOCK_SIZE);
+    uint16_t prev = (first > 0) ? file_blk(fs, root_idx, first - 1) : FAT_EOC;
+    size_t n;
+
+    for (n = 0; n < nblk; n++) {
+        // Blocks past the end of the chain are allocated, reserved blocks
+        // past the end of the file are reused
+        int idx = file_blk(fs, root_idx, first + n);
+        if (idx == FAT_EOC) {
+            idx = alloc_data_blk(fs, root_idx, prev);
+            if (idx == -1) {
+                break;
+            }
+        }
+        blocks[n] = idx + fs->super_blk.data_idx;
+        bufs[n] = buf + n * BLOCK_SIZE;
+        prev = idx;
+    }
+
+    if (cache_writev(fs->blk_cache, blocks, bufs, n) == -1) {
+        return -1;
+    }
+
+    return n * BLOCK_SIZE;
+}
+
+// Read nblk whole blocks at the block aligned offset of file root_idx
+// straight into the current buffer of it, which must have room for them.
+// Return the number of bytes read, or -1 on I/O error.
+static int read_span(struct fs *fs, int root_idx, size_t offset, const struct iov_iter *it, size_t nblk) {
+    size_t first = offset / BLOCK_SIZE;
+    size_t blocks[CACHE_SPAN_MAX];
+    void *bufs[CACHE_SPAN_MAX];
+    char *buf = iter_span(it, nblk * BLOCK_SIZE);
+
+    for (size_t n = 0; n < nblk; n++) {
+        blocks[n] = file_blk(fs, root_idx, first + n) + fs->super_blk.data_idx;
+        bufs[n] = buf + n * BLOCK_SIZE;
+    }
+
+    if (cache_readv(fs->blk_cache, blocks, bufs, nblk) == -1) {
+        return -1;
+    }
+
+    return nblk * BLOCK_SIZE;
+}
+
+static int write_locked(struct fs *fs, int root_idx, struct iov_iter *it, size_t count, size_t offset);
+
+int fsi_write(struct fs *fs, int fd, void *buf, size_t count)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, count, NULL);
+    if (buf == NULL || fd_acquire(fs, fd, 1) == -1) {
+        return STATS_RET(FS_STATS_WRITE, start, -1);
+    }
+
+    struct iovec iov = { buf, count };
+    struct iov_iter it;
+    iter_init(&it, &iov, 1);
+
+    struct fd_table *f = &fs->opened_fd[fd];
+    STATS_OFFSET(start, f->offset);
+    int ret = write_locked(fs, f->root_idx, &it, count, f->offset);
+    if (ret > 0) {
+        f->offset += ret;
+    }
+    STATS_FILE(fs, f->root_idx, start, 1, ret);
+
+    fd_release(fs, fd);
+    return STATS_RET(FS_STATS_WRITE, start, ret);
+}
+
+int fsi_writev(struct fs *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+    STATS_START(start);
+    ssize_t count = iov_total(iov, iovcnt);
+    STATS_ARGS(start, fd, count < 0 ? 0 : count, NULL);
+    if (count == -1 || fd_acquire(fs, fd, 1) == -1) {
+        return STATS_RET(FS_STATS_WRITEV, start, -1);
+    }
+
+    struct iov_iter it;
+    iter_init(&it, iov, iovcnt);
+
+    struct fd_table *f = &fs->opened_fd[fd];
+    STATS_OFFSET(start, f->offset);
+    int ret = write_locked(fs, f->root_idx, &it, count, f->offset);
+    if (ret > 0) {
+        f->offset += ret;
+    }
+    STATS_FILE(fs, f->root_idx, start, 1, ret);
+
+    fd_release(fs, fd);
+    return STATS_RET(FS_STATS_WRITEV, start, ret);
+}
+
+int fsi_pwrite(struct fs *fs, int fd, const void *buf, size_t count, size_t offset)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, count, NULL);
+    STATS_OFFSET(start, offset);
+    int root_idx = buf ? file_acquire(fs, fd, 1) : -1;
+    if (root_idx == -1) {
+        return STATS_RET(FS_STATS_PWRITE, start, -1);
+    }
+
+    struct iovec iov = { (void *)buf, count };
+    struct iov_iter it;
+    iter_init(&it, &iov, 1);
+
+    int ret = -1;
+    if (offset <= fs->rt_dirt[root_idx].file_size) {
+        ret = write_locked(fs, root_idx, &it, count, offset);
+    }
+    STATS_FILE(fs, root_idx, start, 1, ret);
+
+    file_release(fs, root_idx);
+    return STATS_RET(FS_STATS_PWRITE, start, ret);
+}
+
+// Write the count bytes of the buffers of it at offset of file root_idx, which
+// must be within the file. The block of each offset comes straight from the
+// block map, and each block is written once, whatever number of buffers it
+// gets data from.
+static int write_locked(struct fs *fs, int root_idx, struct iov_iter *it, size_t count, size_t offset)
+{
+	/* TODO: Phase 4 */
+
+    struct root *entry = &fs->rt_dirt[root_idx];
+    size_t remaining = count;
+    uint write_size = 0;
+    size_t cur_offset = offset;
+    char bounce[BLOCK_SIZE];
+
+    while (remaining > 0) {
+        size_t logical = cur_offset / BLOCK_SIZE;
+        size_t nblk = iter_blocks(it, remaining / BLOCK_SIZE);
+
+        // Whole blocks go straight from a buffer to the disk
+        if (cur_offset % BLOCK_SIZE == 0 && nblk > 0) {
+            int done = write_span(fs, root_idx, cur_offset, it, nblk);
+            if (done == -1) {
+                return -1;
+            }
+            if (done == 0) {
+                // Disk is full, report what could be written
+                break;
+            }
+            iter_advance(it, done);
+            remaining -= done;
+            write_size += done;
+            cur_offset += done;
+            grow_file(fs, entry, cur_offset);
+            continue;
+        }
+
+        // Writing right after the last block of the chain extends it
+        uint16_t idx = file_blk(fs, root_idx, logical);
+        if (idx == FAT_EOC) {
+            uint16_t last = logical ? file_blk(fs, root_idx, logical - 1) : FAT_EOC;
+            int new_idx = alloc_data_blk(fs, root_idx, last);
+            if (new_idx == -1) {
+                // Disk is full, report what could be written
+                break;
+            }
+            idx = new_idx;
+        }
+
+        size_t data_blk_idx = idx + fs->super_blk.data_idx;
+        size_t offset_in_blk = cur_offset % BLOCK_SIZE;
+        size_t cost = 0;
+
+        if (BLOCK_SIZE - offset_in_blk > remaining) {
+            cost = remaining;
+        } else {
+            cost = BLOCK_SIZE - offset_in_blk;
+        }
+
+        // The old content of the block only matters if file data lies
+        // outside of the written range (never for a freshly allocated block)
+        size_t blk_start = cur_offset - offset_in_blk;
+        size_t valid = entry->file_size > blk_start ? entry->file_size - blk_start : 0;
+        int keep = offset_in_blk > 0 || valid > offset_in_blk + cost;
+
+        // Data spread over several buffers is gathered first
+        const char *src = iter_span(it, cost);
+        if (src != NULL) {
+            iter_advance(it, cost);
+        } else {
+            iter_copy_out(it, bounce, cost);
+            src = bounce;
+        }
+
+        if (cache_write_at(fs->blk_cache, data_blk_idx, offset_in_blk, cost, src, keep) == -1) {
+            return -1;
+        }
+        remaining -= cost;
+        write_size += cost;
+        cur_offset += cost;
+
+        grow_file(fs, entry, cur_offset);
+    }
+
+    return write_size;
+}
+
+// Detect sequential reads on fd and prefetch the blocks that follow a read of
+// count bytes at the current offset. The window doubles on every sequential
+// read and collapses on the first random one.
+static void read_ahead(struct fs *fs, int fd, size_t count) {
+    struct fd_table *f = &fs->opened_fd[fd];
+    size_t file_size = fs->rt_dirt[f->root_idx].file_size;
+
+    // A window larger than half the cache would evict prefetched blocks
+    // before they are read
+    size_t ra_max = fs->in_place ? 0 : fs->cache_blocks / 2;
+    if (ra_max > RA_MAX_BLKS) {
+        ra_max = RA_MAX_BLKS;
+    }
+
+    if (f->offset != f->ra_last_end) {
+        f->ra_window = 0;
+        f->ra_end = 0;
+    } else if (f->ra_window == 0) {
+        f->ra_window = RA_MIN_BLKS;
+    } else {
+        f->ra_window *= 2;
+    }
+    if (f->ra_window > ra_max) {
+        f->ra_window = ra_max;
+    }
+    if (count > file_size - f->offset) {
+        count = file_size - f->offset;
+    }
+    f->ra_last_end = f->offset + count;
+
+    if (f->ra_window == 0 || count == 0 || f->ra_last_end >= file_size) {
+        return;
+    }
+
+    // Only go to disk once at least half a window is missing
+    size_t next = (f->ra_last_end - 1) / BLOCK_SIZE + 1;
+    size_t start = f->ra_end > next ? f->ra_end : next;
+    size_t end = next + f->ra_window;
+    size_t file_blks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (end > file_blks) {
+        end = file_blks;
+    }
+    if (start >= end || (end - start < f->ra_window / 2 && end < file_blks)) {
+        return;
+    }
+
+    size_t blocks[RA_MAX_BLKS];
+    size_t n = 0;
+    for (size_t i = start; i < end; i++) {
+        blocks[n++] = file_blk(fs, f->root_idx, i) + fs->super_blk.data_idx;
+    }
+    // Read-ahead is only a hint, a failure shows up on the actual read
+    if (cache_prefetch(fs->blk_cache, blocks, n) == 0) {
+        f->ra_end = end;
+    }
+}
+
+static int read_locked(struct fs *fs, int root_idx, struct iov_iter *it, size_t count, size_t offset);
+
+int fsi_read(struct fs *fs, int fd, void *buf, size_t count)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, count, NULL);
+    if (buf == NULL || fd_acquire(fs, fd, 0) == -1) {
+        return STATS_RET(FS_STATS_READ, start, -1);
+    }
+
+    struct iovec iov = { buf, count };
+    struct iov_iter it;
+    iter_init(&it, &iov, 1);
+
+    struct fd_table *f = &fs->opened_fd[fd];
+    STATS_OFFSET(start, f->offset);
+    read_ahead(fs, fd, count);
+    int ret = read_locked(fs, f->root_idx, &it, count, f->offset);
+    if (ret > 0) {
+        f->offset += ret;
+    }
+    STATS_FILE(fs, f->root_idx, start, 0, ret);
+
+    fd_release(fs, fd);
+    return STATS_RET(FS_STATS_READ, start, ret);
+}
+
+int fsi_readv(struct fs *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+    STATS_START(start);
+    ssize_t count = iov_total(iov, iovcnt);
+    STATS_ARGS(start, fd, count < 0 ? 0 : count, NULL);
+    if (count == -1 || fd_acquire(fs, fd, 0) == -1) {
+        return STATS_RET(FS_STATS_READV, start, -1);
+    }
+
+    struct iov_iter it;
+    iter_init(&it, iov, iovcnt);
+
+    struct fd_table *f = &fs->opened_fd[fd];
+    STATS_OFFSET(start, f->offset);
+    read_ahead(fs, fd, count);
+    int ret = read_locked(fs, f->root_idx, &it, count, f->offset);
+    if (ret > 0) {
+        f->offset += ret;
+    }
+    STATS_FILE(fs, f->root_idx, start, 0, ret);
+
+    fd_release(fs, fd);
+    return STATS_RET(FS_STATS_READV, start, ret);
+}
+
+int fsi_pread(struct fs *fs, int fd, void *buf, size_t count, size_t offset)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, count, NULL);
+    STATS_OFFSET(start, offset);
+    int root_idx = buf ? file_acquire(fs, fd, 0) : -1;
+    if (root_idx == -1) {
+        return STATS_RET(FS_STATS_PREAD, start, -1);
+    }
+
+    struct iovec iov = { buf, count };
+    struct iov_iter it;
+    iter_init(&it, &iov, 1);
+
+    int ret = -1;
+    if (offset <= fs->rt_dirt[root_idx].file_size) {
+        ret = read_locked(fs, root_idx, &it, count, offset);
+    }
+    STATS_FILE(fs, root_idx, start, 0, ret);
+
+    file_release(fs, root_idx);
+    return STATS_RET(FS_STATS_PREAD, start, ret);
+}
+
+static int copy_out_locked(struct fs *fs, int root_idx, size_t offset, int host_fd, size_t host_offset, size_t count);
+
+int fsi_copy_out(struct fs *fs, int fd, size_t offset, int host_fd, size_t host_offset, size_t count)
+{
+    STATS_START(start);
+    STATS_ARGS(start, fd, count, NULL);
+    STATS_OFFSET(start, offset);
+    int root_idx = host_fd >= 0 ? file_acquire(fs, fd, 0) : -1;
+    if (root_idx == -1) {
+        return STATS_RET(FS_STATS_COPY_OUT, start, -1);
+    }
+
+    int ret = -1;
+    if (offset <= fs->rt_dirt[root_idx].file_size) {
+        ret = copy_out_locked(fs, root_idx, offset, host_fd, host_offset, count);
+    }
+    STATS_FILE(fs, root_idx, start, 0, ret);
+
+    file_release(fs, root_idx);
+    return STATS_RET(FS_STATS_COPY_OUT, start, ret);
+}
+
+// Copy up to count bytes at offset of file root_idx, which must be within the
+// file, to host_fd at host_offset. Every run of consecutive blocks on disk is
+// copied with a single disk_copy_out(), the data never goes through the cache.
+static int copy_out_locked(struct fs *fs, int root_idx, size_t offset, int host_fd, size_t host_offset, size_t count)
+{
+    size_t file_size = fs->rt_dirt[root_idx].file_size;
+    if (count > file_size - offset) {
+        count = file_size - offset;
+    }
+
+    // The disk must hold the latest data of the file
+    if (count > 0 && cache_flush(fs->blk_cache) == -1) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < count) {
+        size_t cur_offset = offset + done;
+        size_t logical = cur_offset / BLOCK_SIZE;
+        uint16_t first = file_blk(fs, root_idx, logical);
+        size_t len = BLOCK_SIZE - cur_offset % BLOCK_SIZE;
+        size_t nblk = 1;
+
+        while (len < count - done && file_blk(fs, root_idx, logical + nblk) == first + nblk) {
+            len += BLOCK_SIZE;
+            nblk++;
+        }
+        if (len > count - done) {
+            len = count - done;
+        }
+
+        if (disk_copy_out(fs->disk, first + fs->super_blk.data_idx, cur_offset % BLOCK_SIZE, len,
+                          host_fd, host_offset + done) == -1) {
+            return -1;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+// Read up to count bytes at offset of file root_idx, which must be within the
+// file, into the buffers of it. The block of each offset comes straight from
+// the block map, and each block is read once, whatever number of buffers it
+// fills.
+static int read_locked(struct fs *fs, int root_idx, struct iov_iter *it, size_t count, size_t offset)
+{
+	/* TODO: Phase 4 */
+
+    // Never read past the end of the file
+    size_t file_size = fs->rt_dirt[root_idx].file_size;
+    if (count > file_size - offset) {
+        count = file_size - offset;
+    }
+
+    size_t remaining = count;
+    uint read_size = 0;
+    size_t cur_offset = offset;
+    char bounce[BLOCK_SIZE];
+
+    while (remaining > 0) {
+        size_t nblk = iter_blocks(it, remaining / BLOCK_SIZE);
+
+        // Whole blocks go straight from the disk to a buffer
+        if (cur_offset % BLOCK_SIZE == 0 && nblk > 0) {
+            int done = read_span(fs, root_idx, cur_offset, it, nblk);
+            if (done == -1) {
+                return -1;
+            }
+            iter_advance(it, done);
+            remaining -= done;
+            read_size += done;
+            cur_offset += done;
+            continue;
+        }
+
+        size_t data_blk_idx = file_blk(fs, root_idx, cur_offset / BLOCK_SIZE) + fs->super_blk.data_idx;
+        size_t offset_in_blk = cur_offset % BLOCK_SIZE;
+        size_t cost = 0;
+
+        if (BLOCK_SIZE - offset_in_blk > remaining) {
+            cost = remaining;
+        } else {
             cost = BLOCK_SIZE - offset_in_blk;
         }
 
-        if (block_read(data_blk_idx, (void *)bounce) == -1) {
-            free(bounce);
+        // Data going to several buffers is scattered from a copy
+        char *dst = iter_span(it, cost);
+        if (cache_read_at(fs->blk_cache, data_blk_idx, offset_in_blk, cost, dst ? dst : bounce) == -1) {
+            return -1;
+        }
+        if (dst != NULL) {
+            iter_advance(it, cost);
+        } else {
+            iter_copy_in(it, bounce, cost);
+        }
+        remaining -= cost;
+        read_size += cost;
+        cur_offset += cost;
+    }
+
+    return read_size;
+}
+
+// Walk the chain of file root_idx into a new array. Return the number of
+// blocks, or -1 if the array cannot be allocated or a FAT block read.
+static ssize_t file_chain(struct fs *fs, int root_idx, uint16_t **chain) {
+    size_t len = 0, cap = 0;
+    uint16_t *blks = NULL;
+
+    for (uint16_t idx = fs->rt_dirt[root_idx].first_data_idx; idx != FAT_EOC; idx = fat_get(fs, idx)) {
+        if (len == cap) {
+            cap = cap ? cap * 2 : 64;
+            uint16_t *more = realloc(blks, cap * sizeof(uint16_t));
+            if (more == NULL) {
+                free(blks);
+                return -1;
+            }
+            blks = more;
+        }
+        blks[len++] = idx;
+    }
+
+    *chain = blks;
+    return len;
+}
+
+int fsi_frag(struct fs *fs, struct fs_frag *frag)
+{
+    if (frag == NULL) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    memset(frag, 0, sizeof(*frag));
+    int ret = fat_scan_all(fs);
+    for (int i = 0; i < FS_FILE_MAX_COUNT && ret == 0; i++) {
+        uint16_t *chain;
+        ssize_t len;
+
+        if (fs->rt_dirt[i].file_name[0] == '\0' || fs->rt_dirt[i].first_data_idx == FAT_EOC) {
+            continue;
+        }
+        len = file_chain(fs, i, &chain);
+        if (len == -1) {
+            ret = -1;
+            break;
+        }
+
+        uint32_t extents = 1;
+        for (ssize_t j = 1; j < len; j++) {
+            extents += chain[j] != chain[j - 1] + 1;
+        }
+        frag->files++;
+        frag->fragmented += extents > 1;
+        frag->extents += extents;
+        frag->blocks += len;
+        free(chain);
+    }
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    // Share of the blocks that do not follow the previous block of their file
+    if (frag->blocks > frag->files) {
+        frag->score = (double)(frag->extents - frag->files) / (frag->blocks - frag->files);
+    }
+    return ret;
+}
+
+static int defrag_locked(struct fs *fs, size_t max_blocks);
+
+int fsi_defrag(struct fs *fs, size_t max_blocks)
+{
+    STATS_START(start);
+    STATS_ARGS(start, -1, max_blocks, NULL);
+    pthread_rwlock_wrlock(&fs->fs_lock);
+    int ret = defrag_locked(fs, max_blocks ? max_blocks : SIZE_MAX);
+    pthread_rwlock_unlock(&fs->fs_lock);
+
+    return STATS_RET(FS_STATS_DEFRAG, start, ret);
+}
+
+// Chains of all the files during a step of fs_defrag(), and who owns each block
+struct defrag {
+    uint16_t *chains[FS_FILE_MAX_COUNT];    // NULL for an empty file
+    size_t lens[FS_FILE_MAX_COUNT];
+    size_t blocks;          // Total length of the chains
+    int *owner;             // File of each data block, NO_SLOT if none
+    uint16_t *pos;          // Index of each data block in the chain of its file
+    struct bitmap old;      // Blocks moved away from, free after the next sync
+    struct bitmap fixed;    // Blocks in use outside the files, like the journal
+    char *buf;              // Room to copy DEFRAG_BATCH blocks
+    size_t moved;
+    size_t budget;
+};
+
+static void defrag_destroy(struct defrag *d) {
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        free(d->chains[i]);
+    }
+    free(d->owner);
+    free(d->pos);
+    free(d->buf);
+    bitmap_destroy(&d->old);
+    bitmap_destroy(&d->fixed);
+}
+
+// Read the chains of all the files. Return -1 if memory cannot be allocated
+// or the FAT cannot be read.
+static int defrag_init(struct fs *fs, struct defrag *d, size_t budget) {
+    size_t nblk = fs->super_blk.data_block_num;
+
+    memset(d, 0, sizeof(*d));
+    d->budget = budget;
+    d->owner = malloc(nblk * sizeof(int));
+    d->pos = malloc(nblk * sizeof(uint16_t));
+    d->buf = malloc(DEFRAG_BATCH * BLOCK_SIZE);
+    if (d->owner == NULL || d->pos == NULL || d->buf == NULL || bitmap_init(&d->old, nblk) == -1 ||
+        bitmap_init(&d->fixed, nblk) == -1 || fat_scan_all(fs) == -1) {
+        defrag_destroy(d);
+        return -1;
+    }
+
+    for (size_t i = 0; i < nblk; i++) {
+        d->owner[i] = NO_SLOT;
+    }
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (fs->rt_dirt[i].file_name[0] == '\0' || fs->rt_dirt[i].first_data_idx == FAT_EOC) {
+            continue;
+        }
+        ssize_t n = file_chain(fs, i, &d->chains[i]);
+        if (n == -1) {
+            defrag_destroy(d);
+            return -1;
+        }
+        d->lens[i] = n;
+        d->blocks += n;
+        for (ssize_t j = 0; j < n; j++) {
+            d->owner[d->chains[i][j]] = i;
+            d->pos[d->chains[i][j]] = j;
+        }
+    }
+
+    // What is neither free nor part of a file must stay where it is
+    for (size_t i = 1; i < nblk; i++) {
+        if (d->owner[i] == NO_SLOT && !bitmap_test(&fs->free_blks, i)) {
+            bitmap_set(&d->fixed, i);
+        }
+    }
+    return 0;
+}
+
+// Move blocks j to j + count - 1 of file f to the free blocks from dst on.
+// The data is copied first, then the copies are linked in place of the
+// originals, which are marked in d->old instead of being freed. Return -1 on
+// error.
+static int defrag_move(struct fs *fs, struct defrag *d, int f, size_t j, size_t count, size_t dst) {
+    uint16_t *chain = d->chains[f];
+    size_t n = d->lens[f];
+
+    for (size_t b = 0; b < count; b += DEFRAG_BATCH) {
+        size_t m = count - b < DEFRAG_BATCH ? count - b : DEFRAG_BATCH;
+        size_t from[DEFRAG_BATCH], to[DEFRAG_BATCH];
+        void *rbufs[DEFRAG_BATCH];
+        const void *wbufs[DEFRAG_BATCH];
+
+        // Through the cache, which may hold newer contents than the disk
+        for (size_t k = 0; k < m; k++) {
+            from[k] = chain[j + b + k] + fs->super_blk.data_idx;
+            to[k] = dst + b + k + fs->super_blk.data_idx;
+            rbufs[k] = d->buf + k * BLOCK_SIZE;
+            wbufs[k] = rbufs[k];
+        }
+        if (cache_readv(fs->blk_cache, from, rbufs, m) == -1 ||
+            cache_writev(fs->blk_cache, to, wbufs, m) == -1) {
             return -1;
         }
 
-        memcpy((char *)(buf + buf_pos), bounce + cur_offset % BLOCK_SIZE, cost);
-        buf_pos += cost;
-        remaining -= cost;
-        read_size += cost;
-        cur_offset += cost;
+        for (size_t k = j + b; k < j + b + m; k++) {
+            uint16_t idx = dst + k - j;
+
+            if (fat_set(fs, idx, k + 1 < n ? chain[k + 1] : FAT_EOC) == -1) {
+                return -1;
+            }
+            bitmap_clear(&fs->free_blks, idx);
+            if (k == 0) {
+                fs->rt_dirt[f].first_data_idx = idx;
+                fs->rdir_dirty = 1;
+            } else if (fat_set(fs, chain[k - 1], idx) == -1) {
+                return -1;
+            }
+            if (fat_set(fs, chain[k], 0) == -1) {
+                return -1;
+            }
+            bitmap_set(&d->old, chain[k]);
+            d->owner[chain[k]] = NO_SLOT;
+            d->owner[idx] = f;
+            d->pos[idx] = k;
+            chain[k] = idx;
+        }
+    }
+
+    map_reset(fs, f);
+    d->moved += count;
+    return 0;
+}
 
-        fs_lseek(fd, cur_offset);
-        free(bounce);
+// Number of blocks at the start of chain[n] that follow each other on disk
+static size_t contiguous_prefix(const uint16_t *chain, size_t n) {
+    size_t k = 1;
+    while (k < n && chain[k] == chain[0] + k) {
+        k++;
     }
+    return k;
+}
 
-    return read_size;
+// Make each fragmented file contiguous, growing its first extent in place when
+// the blocks after it are free, or else in the first free run large enough.
+// Set *stuck if one of them fits nowhere. Return -1 on error.
+static int defrag_place(struct fs *fs, struct defrag *d, int *stuck) {
+    for (int i = 0; i < FS_FILE_MAX_COUNT && d->moved < d->budget; i++) {
+        uint16_t *chain = d->chains[i];
+        size_t n = d->lens[i];
+        size_t k = chain ? contiguous_prefix(chain, n) : n;
+        size_t target = chain ? chain[0] : BITMAP_NONE, from = k;
+
+        if (k == n) {
+            continue;
+        }
+        if (chain[0] + n > fs->super_blk.data_block_num ||
+            bitmap_find_run(&fs->free_blks, chain[0] + k, n - k) != chain[0] + k) {
+            target = bitmap_find_run(&fs->free_blks, 1, n);
+            from = 0;
+        }
+        if (target == BITMAP_NONE) {
+            *stuck = 1;
+            continue;
+        }
+
+        size_t count = n - from < d->budget - d->moved ? n - from : d->budget - d->moved;
+        if (defrag_move(fs, d, i, from, count, target + from) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Make the moves so far durable, then free the blocks moved away from. If
+// that fails, they stay out of use until the next mount.
+static int defrag_commit(struct fs *fs, struct defrag *d) {
+    if (bitmap_count(&d->old) == 0) {
+        return 0;
+    }
+    if (sync_locked(fs) == -1) {
+        return -1;
+    }
+    for (size_t i = bitmap_find(&d->old, 0); i != BITMAP_NONE; i = bitmap_find(&d->old, i + 1)) {
+        bitmap_clear(&d->old, i);
+        bitmap_set(&fs->free_blks, i);
+    }
+    return 0;
+}
+
+// Return the first block from p on that starts n blocks clear of fixed ones,
+// or BITMAP_NONE if there are none.
+static size_t defrag_window(struct fs *fs, struct defrag *d, size_t p, size_t n) {
+    size_t run = 0;
+    while (run < n) {
+        if (p + run >= fs->super_blk.data_block_num) {
+            return BITMAP_NONE;
+        }
+        if (bitmap_test(&d->fixed, p + run)) {
+            p += run + 1;
+            run = 0;
+        } else {
+            run++;
+        }
+    }
+    return p;
+}
+
+// Pack the files back to back from the first data block, in directory order,
+// going around the fixed blocks. A block in the way goes to a free block past
+// the packed area when possible, and its place is filled once the move is
+// committed. Files that no longer fit are left out. Return -1 on error.
+static int defrag_pack(struct fs *fs, struct defrag *d) {
+    size_t starts[FS_FILE_MAX_COUNT];
+    size_t end = 1;
+
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        starts[i] = d->lens[i] ? defrag_window(fs, d, end, d->lens[i]) : BITMAP_NONE;
+        if (starts[i] != BITMAP_NONE) {
+            end = starts[i] + d->lens[i];
+        }
+    }
+
+    for (;;) {
+        size_t before = d->moved;
+
+        for (int i = 0; i < FS_FILE_MAX_COUNT && d->moved < d->budget; i++) {
+            if (starts[i] == BITMAP_NONE) {
+                continue;
+            }
+            for (size_t j = 0; j < d->lens[i] && d->moved < d->budget; j++) {
+                size_t p = starts[i] + j;
+                int ret = 0;
+
+                if (d->chains[i][j] == p) {
+                    continue;
+                }
+                if (bitmap_test(&fs->free_blks, p)) {
+                    ret = defrag_move(fs, d, i, j, 1, p);
+                } else if (d->owner[p] != NO_SLOT) {
+                    size_t dst = bitmap_find(&fs->free_blks, end);
+                    if (dst == BITMAP_NONE) {
+                        dst = bitmap_find(&fs->free_blks, 1);
+                    }
+                    if (dst != BITMAP_NONE) {
+                        ret = defrag_move(fs, d, d->owner[p], d->pos[p], 1, dst);
+                    }
+                }
+                if (ret == -1) {
+                    return -1;
+                }
+            }
+        }
+
+        // With little free space, the blocks just moved away from are needed
+        if (d->moved == before || d->moved >= d->budget) {
+            return 0;
+        }
+        if (defrag_commit(fs, d) == -1) {
+            return -1;
+        }
+    }
+}
+
+static int defrag_locked(struct fs *fs, size_t max_blocks)
+{
+    struct defrag d;
+
+    // Blocks freed by a deletion are reused only once it is committed
+    if (fs->journaled && bitmap_count(&fs->freed_blks) > 0 && sync_locked(fs) == -1) {
+        return -1;
+    }
+    if (defrag_init(fs, &d, max_blocks) == -1) {
+        return -1;
+    }
+
+    // Files are made contiguous one by one while there is room for them. Once
+    // free space is too scattered for one of them, the following steps pack
+    // all the files instead, until they are all in place.
+    int ret = 0, stuck = 0;
+    if (!fs->defrag_packing) {
+        ret = defrag_place(fs, &d, &stuck);
+        fs->defrag_packing = stuck;
+    }
+    if (ret == 0 && fs->defrag_packing && d.moved == 0) {
+        ret = defrag_pack(fs, &d);
+        fs->defrag_packing = d.moved > 0;
+    }
+
+    // The new chains reach the disk before the old blocks can be reused
+    if (ret == 0) {
+        ret = defrag_commit(fs, &d);
+    }
+    size_t moved = d.moved;
+    defrag_destroy(&d);
+
+    return ret == -1 ? -1 : (int)moved;
+}
+
+// Instance used by the fs_* functions, and the cache size it gets mounted with
+static struct fs *cur_fs = NULL;
+static size_t cur_cache_blocks = CACHE_DEFAULT_BLOCKS;
+static pthread_rwlock_t cur_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Return the result of call on cur_fs, or -1 if nothing is mounted
+#define ON_CUR_FS(call)                         \
+    do {                                        \
+        int ret = -1;                           \
+        pthread_rwlock_rdlock(&cur_lock);       \
+        if (cur_fs != NULL) {                   \
+            ret = call;                         \
+        }                                       \
+        pthread_rwlock_unlock(&cur_lock);       \
+        return ret;                             \
+    } while (0)
+
+int fs_format(const char *diskname, size_t data_blocks)
+{
+    size_t fat_blks = (data_blocks + FAT_PER_BLK - 1) / FAT_PER_BLK;
+    size_t total = 1 + fat_blks + 1 + data_blocks;
+
+    if (data_blocks == 0 || data_blocks >= FAT_EOC || total > UINT16_MAX || fat_blks > UINT8_MAX) {
+        return -1;
+    }
+
+    // Sparse file, every block reads as zeros
+    int fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = ftruncate(fd, total * BLOCK_SIZE);
+    close(fd);
+    if (ret == -1) {
+        return -1;
+    }
+
+    struct superblock sb;
+    uint16_t fat[FAT_PER_BLK] = { FAT_EOC };
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.signature, "ECS150FS", 8);
+    sb.total_blk_num = total;
+    sb.rdir_idx = 1 + fat_blks;
+    sb.data_idx = 2 + fat_blks;
+    sb.data_block_num = data_blocks;
+    sb.fat_blk_num = fat_blks;
+
+    struct disk *d = disk_open(diskname, 0);
+    if (d == NULL) {
+        return -1;
+    }
+    ret = 0;
+    if (disk_write(d, SUPER_BLK_IDX, &sb) == -1 || disk_write(d, SUPER_BLK_IDX + 1, fat) == -1 || disk_sync(d) == -1) {
+        ret = -1;
+    }
+    disk_close(d);
+
+    return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+    return fs_mount_flags(diskname, 0);
+}
+
+int fs_mount_flags(const char *diskname, int flags)
+{
+    int ret = -1;
+
+    pthread_rwlock_wrlock(&cur_lock);
+    if (cur_fs == NULL) {
+        cur_fs = fsi_mount(diskname, flags, cur_cache_blocks);
+        ret = cur_fs ? 0 : -1;
+    }
+    pthread_rwlock_unlock(&cur_lock);
+
+    return ret;
+}
+
+int fs_umount(void)
+{
+    pthread_rwlock_wrlock(&cur_lock);
+    int ret = cur_fs ? fsi_umount(cur_fs) : -1;
+    if (ret == 0) {
+        cur_fs = NULL;
+    }
+    pthread_rwlock_unlock(&cur_lock);
+
+    return ret;
+}
+
+int fs_cache_size(size_t nblocks)
+{
+    pthread_rwlock_wrlock(&cur_lock);
+    // The cache is sized when the disk gets mounted
+    int ret = cur_fs ? -1 : 0;
+    if (cur_fs == NULL) {
+        cur_cache_blocks = nblocks;
+    }
+    pthread_rwlock_unlock(&cur_lock);
+
+    return ret;
+}
+
+int fs_fat_budget(size_t nblocks)
+{
+    ON_CUR_FS(fsi_fat_budget(cur_fs, nblocks));
+}
+
+int fs_amp(const char *filename, struct fs_amp *amp)
+{
+    ON_CUR_FS(fsi_amp(cur_fs, filename, amp));
+}
+
+int fs_frag(struct fs_frag *frag)
+{
+    ON_CUR_FS(fsi_frag(cur_fs, frag));
+}
+
+int fs_defrag(size_t max_blocks)
+{
+    ON_CUR_FS(fsi_defrag(cur_fs, max_blocks));
+}
+
+int fs_trace_start(const char *path)
+{
+#ifdef FS_STATS
+    return trace_open(path);
+#else
+    (void)path;
+    return -1;
+#endif
+}
+
+int fs_trace_stop(void)
+{
+    return trace_close();
+}
+
+int fs_stats_get(struct fs_stats *st)
+{
+#ifdef FS_STATS
+    uint64_t *dst = (uint64_t *)st;
+    uint64_t *src = (uint64_t *)&stats;
+
+    for (size_t i = 0; i < sizeof(stats) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    disk_stats(&st->blk_reads, &st->blk_writes);
+    return 0;
+#else
+    (void)st;
+    return -1;
+#endif
+}
+
+int fs_stats_reset(void)
+{
+#ifdef FS_STATS
+    uint64_t *counters = (uint64_t *)&stats;
+
+    for (size_t i = 0; i < sizeof(stats) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+    disk_stats_reset();
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int fs_flush(void)
+{
+    ON_CUR_FS(fsi_flush(cur_fs));
+}
+
+int fs_sync(void)
+{
+    ON_CUR_FS(fsi_sync(cur_fs));
+}
+
+int fs_info(void)
+{
+    ON_CUR_FS(fsi_info(cur_fs));
+}
+
+int fs_create(const char *filename)
+{
+    ON_CUR_FS(fsi_create(cur_fs, filename));
+}
+
+int fs_delete(const char *filename)
+{
+    ON_CUR_FS(fsi_delete(cur_fs, filename));
+}
+
+int fs_ls(void)
+{
+    ON_CUR_FS(fsi_ls(cur_fs));
+}
+
+int fs_open(const char *filename)
+{
+    ON_CUR_FS(fsi_open(cur_fs, filename));
+}
+
+int fs_close(int fd)
+{
+    ON_CUR_FS(fsi_close(cur_fs, fd));
+}
+
+int fs_stat(int fd)
+{
+    ON_CUR_FS(fsi_stat(cur_fs, fd));
 }
 
+int fs_lseek(int fd, size_t offset)
+{
+    ON_CUR_FS(fsi_lseek(cur_fs, fd, offset));
+}
+
+int fs_reserve(int fd, size_t bytes)
+{
+    ON_CUR_FS(fsi_reserve(cur_fs, fd, bytes));
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+    ON_CUR_FS(fsi_write(cur_fs, fd, buf, count));
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+    ON_CUR_FS(fsi_read(cur_fs, fd, buf, count));
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ON_CUR_FS(fsi_writev(cur_fs, fd, iov, iovcnt));
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ON_CUR_FS(fsi_readv(cur_fs, fd, iov, iovcnt));
+}
+
+int fs_list(char names[][FS_FILENAME_LEN])
+{
+    ON_CUR_FS(fsi_list(cur_fs, names));
+}
+
+int fs_copy_out(int fd, size_t offset, int host_fd, size_t host_offset, size_t count)
+{
+    ON_CUR_FS(fsi_copy_out(cur_fs, fd, offset, host_fd, host_offset, count));
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+    ON_CUR_FS(fsi_pwrite(cur_fs, fd, buf, count, offset));
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+    ON_CUR_FS(fsi_pread(cur_fs, fd, buf, count, offset));
+}
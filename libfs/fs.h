@@ -1,11 +1,21 @@
 #ifndef _FS_H
 #define _FS_H
 
-/**
- * WARNING: YOU ARE NOT ALLOWED TO MODIFY THIS FILE!
+/*
+ * File system: a FAT-based, flat (root directory only) file system stored on
+ * a virtual disk, compatible with the reference tools (fs_make.x and fs_ref.x).
+ *
+ * The fs_* functions work on the file system mounted by fs_mount() or
+ * fs_mount_flags(), the fsi_* functions on any number of instances returned by
+ * fsi_mount(). Files are created, deleted and listed by name, then accessed
+ * through file descriptors with sequential, positioned or vectored reads and
+ * writes. The remaining functions control caching and durability, report and
+ * reduce fragmentation, and collect statistics and traces.
  */
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/uio.h> /* for struct iovec */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -16,6 +26,27 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/*
+ * Every function can be called from several threads at once. Reads of any
+ * files, through different file descriptors, run in parallel; a write excludes
+ * the other accesses to the same file only. Creating, deleting or listing
+ * files, fs_info() and fs_sync() wait for every pending operation to finish.
+ */
+
+/**
+ * fs_format - Create an empty file system
+ * @diskname: Name of the virtual disk file, created or overwritten
+ * @data_blocks: Number of data blocks
+ *
+ * Write a virtual disk file holding an empty file system with the same
+ * layout as the fs_make.x tool: superblock, FAT, root directory, then
+ * @data_blocks data blocks.
+ *
+ * Return: -1 if @data_blocks is 0 or too large for the on-disk format, or if
+ * the virtual disk file cannot be written. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -29,6 +60,57 @@
  */
 int fs_mount(const char *diskname);
 
+/** Map the virtual disk in memory and use the FAT and root directory in place */
+#define FS_MOUNT_MMAP 0x1
+
+/** Keep multi-block transfers in flight through io_uring when available */
+#define FS_MOUNT_URING 0x2
+
+/** Log metadata changes in a journal, creating one on the disk if needed */
+#define FS_MOUNT_JOURNAL 0x4
+
+/** Read FAT blocks on first access instead of at mount time */
+#define FS_MOUNT_LAZY 0x8
+
+/**
+ * fs_mount_flags - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of FS_MOUNT_* flags, 0 to behave like fs_mount()
+ *
+ * With %FS_MOUNT_MMAP, the virtual disk file is memory-mapped: block accesses
+ * become memory copies, the FAT and the root directory are not copied at mount
+ * time but accessed inside the mapping, and the block cache is disabled.
+ * Changes are pushed to the file with msync() by fs_flush(), fs_sync() and
+ * fs_umount().
+ *
+ * With %FS_MOUNT_URING, the block-aligned parts of large fs_read() and
+ * fs_write() calls and the cache write-back submit all their disk requests at
+ * once through io_uring. Kernels without io_uring fall back to the default
+ * synchronous backend.
+ *
+ * With %FS_MOUNT_JOURNAL, a journal region is carved out of the end of the data
+ * blocks (marked as used in the FAT) and declared in the superblock, unless
+ * the disk already has one. Whatever the flags, a disk with a journal gets its
+ * committed transactions replayed at mount time and logs its metadata changes:
+ * fs_sync() appends the modified FAT blocks and root directory to the journal
+ * as one atomic transaction, and they are only written to their home location
+ * when the journal fills up or at unmount. Blocks freed by fs_delete() can only
+ * be reused once the deletion is committed. %FS_MOUNT_MMAP then only maps the
+ * data blocks, the metadata is not modified in place.
+ *
+ * With %FS_MOUNT_LAZY, mounting only reads the superblock and the root
+ * directory. A FAT block is read the first time one of its entries is
+ * needed, and the whole FAT only gets read once space must be allocated or
+ * counted (fs_write() past the allocated blocks, fs_reserve(), fs_info()).
+ * See fs_fat_budget() to bound the memory held by the loaded FAT blocks. The
+ * flag has no effect with %FS_MOUNT_MMAP, which maps the FAT instead.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened or mapped, if no
+ * valid file system can be located, if the journal cannot be replayed, or if
+ * there is no room to create a journal. 0 otherwise.
+ */
+int fs_mount_flags(const char *diskname, int flags);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -86,6 +168,18 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_list - Get the names of the files
+ * @names: Array of %FS_FILE_MAX_COUNT names to fill
+ *
+ * Fill the first entries of @names with the NULL-terminated names of the files
+ * located in the root directory, in the order of the directory.
+ *
+ * Return: -1 if no FS is currently mounted, or if @names is NULL. Otherwise
+ * return the number of files.
+ */
+int fs_list(char names[][FS_FILENAME_LEN]);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -143,6 +237,23 @@ int fs_stat(int fd);
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_reserve - Preallocate data blocks for a file
+ * @fd: File descriptor
+ * @bytes: Number of bytes, from the beginning of the file, to reserve space for
+ *
+ * Make sure that the file referenced by file descriptor @fd owns enough data
+ * blocks to hold @bytes bytes, allocating the missing ones as a single run of
+ * consecutive blocks when the disk has one. The size of the file is not
+ * changed: the reserved blocks are used by later fs_write() calls that extend
+ * the file, which then does not need to allocate anything.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if there are not enough
+ * free blocks on disk (nothing is allocated then). 0 otherwise.
+ */
+int fs_reserve(int fd, size_t bytes);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -186,4 +297,379 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Like fs_write(), but write at @offset instead of the file offset of @fd,
+ * which is neither used nor changed. Threads can share @fd: concurrent calls
+ * on the same file descriptor are not serialized by it.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number
+ * of bytes actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Like fs_read(), but read from @offset instead of the file offset of @fd,
+ * which is neither used nor changed. Threads can share @fd: concurrent calls
+ * on the same file descriptor run in parallel. Positional reads are taken as
+ * random accesses and do not trigger any read-ahead.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number
+ * of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to write in the file, one after the other
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Like fs_write() with the concatenation of the @iovcnt buffers of @iov, in a
+ * single pass: a block that gets data from several buffers is written once,
+ * instead of once per buffer with as many fs_write() calls.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is invalid (NULL,
+ * negative @iovcnt, NULL buffer, or more than INT32_MAX bytes in total).
+ * Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to fill, one after the other
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Like fs_read() into the concatenation of the @iovcnt buffers of @iov, in a
+ * single pass: a block that fills several buffers is read once.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov is invalid (NULL,
+ * negative @iovcnt, NULL buffer, or more than INT32_MAX bytes in total).
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_copy_out - Copy part of a file to a host file
+ * @fd: File descriptor
+ * @offset: File offset to copy from
+ * @host_fd: File descriptor of a host file open for writing
+ * @host_offset: Offset in the host file to copy to
+ * @count: Number of bytes to copy
+ *
+ * Like fs_pread() followed by a pwrite() of the data to @host_fd, without the
+ * data going through a user buffer when the kernel can copy from the virtual
+ * disk file to the host file: every run of consecutive data blocks is then
+ * transferred with a single copy_file_range(). Neither the file offset of @fd
+ * nor the one of @host_fd are used or changed. Threads can share @fd.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @host_fd is negative,
+ * or if @offset is larger than the current file size, or if the copy failed.
+ * Otherwise return the number of bytes copied, smaller than @count at the end
+ * of the file.
+ */
+int fs_copy_out(int fd, size_t offset, int host_fd, size_t host_offset, size_t count);
+
+/**
+ * fs_flush - Write back cached data blocks
+ *
+ * Data written with fs_write() is kept in a write-back block cache and only
+ * reaches the virtual disk when it gets evicted, when fs_umount() is called or
+ * when this function is called. On a file system mounted with %FS_MOUNT_MMAP,
+ * the whole mapping (including the FAT and root directory) is synced instead.
+ * Use fs_sync() to also persist the metadata of a file system mounted without
+ * %FS_MOUNT_MMAP.
+ *
+ * Return: -1 if no FS is currently mounted, or if one of the writes failed. 0
+ * otherwise.
+ */
+int fs_flush(void);
+
+/**
+ * fs_sync - Make every change durable
+ *
+ * Write back the cached data blocks, then the FAT blocks and the root
+ * directory if they were modified since the last sync, and wait for the
+ * virtual disk file to reach stable storage. Unchanged metadata blocks are not
+ * written. fs_umount() goes through the same path.
+ *
+ * With a journal, the metadata blocks are committed to the journal instead, so
+ * every change made since the previous call becomes durable atomically, with
+ * a single sequential write and a single flush.
+ *
+ * Concurrent callers are grouped: a caller arriving while a sync is running
+ * waits for the next one, which covers the changes of every waiting caller.
+ *
+ * Return: -1 if no FS is currently mounted, or if one of the writes failed. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_cache_size - Set the size of the block cache
+ * @nblocks: Number of data blocks the cache can hold
+ *
+ * Configure the block cache used by the next fs_mount(). A size of 0 disables
+ * caching and makes every read and write go straight to the virtual disk.
+ *
+ * Return: -1 if a FS is currently mounted. 0 otherwise.
+ */
+int fs_cache_size(size_t nblocks);
+
+/**
+ * fs_fat_budget - Bound the number of loaded FAT blocks
+ * @nblocks: Number of FAT blocks to keep in memory, 0 for no limit
+ *
+ * On a file system mounted with %FS_MOUNT_LAZY, loading a FAT block beyond
+ * @nblocks first drops a clean one, which is read again when next needed.
+ * Blocks with changes that are not at their home location yet are never
+ * dropped, so the bound can be exceeded until the next fs_sync().
+ *
+ * Return: -1 if no FS is currently mounted or if it was not mounted with
+ * %FS_MOUNT_LAZY. 0 otherwise.
+ */
+int fs_fat_budget(size_t nblocks);
+
+/* Layout of the files on the disk */
+struct fs_frag {
+    uint32_t files;         // Files holding at least one data block
+    uint32_t fragmented;    // Files in more than one extent
+    uint32_t extents;       // Runs of consecutive data blocks, over all files
+    uint32_t blocks;        // Data blocks of all files
+    double score;           // 0 when every file is contiguous, 1 when no block
+                            // follows the previous block of its file
+};
+
+/**
+ * fs_frag - Measure the fragmentation of the files
+ * @frag: Filled with the counts and score
+ *
+ * The score is the share of the blocks that do not come right after the
+ * previous block of their file, first blocks excluded.
+ *
+ * Return: -1 if no FS is currently mounted or if the FAT cannot be read. 0
+ * otherwise.
+ */
+int fs_frag(struct fs_frag *frag);
+
+/**
+ * fs_defrag - Make the files contiguous, a few blocks at a time
+ * @max_blocks: Most data blocks to move, 0 for no limit
+ *
+ * Rewrite the FAT chain of each fragmented file into a single ascending run:
+ * in place when the blocks after its first extent are free, otherwise in the
+ * first free run large enough to hold it. When free space is too scattered
+ * for one of the files, the following calls pack all the files back to back
+ * from the start of the disk, in directory order, moving the blocks in the way
+ * to free space first. Data is copied to the new blocks before they are
+ * linked, and the old blocks are only reused once the changes are synced. With
+ * a journal, a crash thus leaves every file with either its old or its new
+ * blocks.
+ *
+ * The other calls wait while a step runs, so call it repeatedly with a small
+ * @max_blocks to defragment a busy file system; each step picks up where the
+ * previous one stopped. Use fs_frag() to follow the progress.
+ *
+ * Return: -1 if no FS is currently mounted, or if memory cannot be allocated,
+ * or if one of the reads or writes failed. Otherwise return the number of
+ * blocks moved, 0 once there is nothing left to improve.
+ */
+int fs_defrag(size_t max_blocks);
+
+/** Operations counted by fs_stats_get(), each fs_* function and its fsi_* twin */
+enum fs_stats_op {
+    FS_STATS_MOUNT,
+    FS_STATS_UMOUNT,
+    FS_STATS_INFO,
+    FS_STATS_CREATE,
+    FS_STATS_DELETE,
+    FS_STATS_LS,
+    FS_STATS_OPEN,
+    FS_STATS_CLOSE,
+    FS_STATS_STAT,
+    FS_STATS_LSEEK,
+    FS_STATS_WRITE,
+    FS_STATS_READ,
+    FS_STATS_RESERVE,
+    FS_STATS_FLUSH,
+    FS_STATS_SYNC,
+    FS_STATS_PWRITE,
+    FS_STATS_PREAD,
+    FS_STATS_WRITEV,
+    FS_STATS_READV,
+    FS_STATS_COPY_OUT,
+    FS_STATS_DEFRAG,
+    FS_STATS_OP_COUNT
+};
+
+/** Number of latency buckets, bucket i counts calls of [2^i, 2^(i+1)) ns */
+#define FS_STATS_BUCKETS 32
+
+/* Counters of one operation */
+struct fs_op_stats {
+    uint64_t calls;
+    uint64_t errors;        // Calls that returned -1
+    uint64_t bytes;         // Bytes moved by fs_read() and fs_write()
+    uint64_t blk_reads;     // Blocks read from the disk during the calls
+    uint64_t blk_writes;    // Blocks written to the disk during the calls
+    uint64_t lat_hist[FS_STATS_BUCKETS];
+};
+
+/* Counters of the whole library */
+struct fs_stats {
+    struct fs_op_stats ops[FS_STATS_OP_COUNT];
+    uint64_t fat_hops;      // FAT entries followed to locate file blocks
+    uint64_t blk_reads;     // Blocks read from the virtual disks
+    uint64_t blk_writes;    // Blocks written to the virtual disks
+};
+
+/**
+ * fs_stats_get - Get the operation counters
+ * @st: Filled with the counters
+ *
+ * The counters cover every file system instance, mounted or not anymore,
+ * since the library was loaded or since the last fs_stats_reset(). They are
+ * only maintained when the library is built with FS_STATS (the default, see
+ * libfs/Makefile); otherwise the instrumentation is compiled out.
+ *
+ * Return: -1 if the library was built without FS_STATS. 0 otherwise.
+ */
+int fs_stats_get(struct fs_stats *st);
+
+/**
+ * fs_stats_reset - Reset the operation counters
+ *
+ * Return: -1 if the library was built without FS_STATS. 0 otherwise.
+ */
+int fs_stats_reset(void);
+
+/* Application bytes against device bytes */
+struct fs_amp {
+    uint64_t logical_read;      // Bytes returned by fs_read()
+    uint64_t logical_written;   // Bytes accepted by fs_write()
+    uint64_t physical_read;     // Bytes read from the virtual disk
+    uint64_t physical_written;  // Bytes written to the virtual disk
+};
+
+/**
+ * fs_amp - Get the I/O amplification of a file or of the file system
+ * @filename: File name, or NULL for the whole file system
+ * @amp: Filled with the counters
+ *
+ * Divide a physical count by the matching logical count to get the read or
+ * write amplification. The counters start at mount time. For the whole file
+ * system, the physical counts cover all the disk traffic, including the
+ * metadata, mount and syncs. For a file, they cover the traffic of the
+ * fs_read() and fs_write() calls on it since it was created or mounted;
+ * cached data written back later by fs_sync() or fs_umount() is not charged
+ * to the file. The read and write amplification of the whole file system are
+ * also displayed by fs_info(). Like fs_stats_get(), this needs FS_STATS.
+ *
+ * Return: -1 if no FS is currently mounted, if @filename is not the name of
+ * a file, or if the library was built without FS_STATS. 0 otherwise.
+ */
+int fs_amp(const char *filename, struct fs_amp *amp);
+
+/**
+ * fs_trace_start - Record the fs_* calls in a trace
+ * @path: Name of the trace file, created or truncated
+ *
+ * Every later call to the fs_* and fsi_* functions that fs_stats_get() counts
+ * is appended to the trace: operation, file descriptor, name, byte count or
+ * offset, file offset of reads and writes, start time, duration, result and
+ * calling thread. The binary format is described in libfs/trace.h, and
+ * apps/replay_fs.x replays a trace. Data contents are not recorded. Tracing
+ * needs FS_STATS.
+ *
+ * Return: -1 if a trace is already being recorded, if @path cannot be
+ * created, or if the library was built without FS_STATS. 0 otherwise.
+ */
+int fs_trace_start(const char *path);
+
+/**
+ * fs_trace_stop - Stop recording and close the trace
+ *
+ * Return: -1 if no trace is being recorded or if writing it failed. 0
+ * otherwise.
+ */
+int fs_trace_stop(void);
+
+/*
+ * Handle-based interface. Every fsi_mount() call mounts an independent file
+ * system instance, so that one process can serve several disks at once, from
+ * any number of threads. Each fsi_* function behaves like the fs_* function of
+ * the same name, on instance @fs instead of the one mounted by fs_mount().
+ * File descriptors are local to their instance. The same virtual disk file
+ * must not be mounted twice at the same time.
+ */
+
+/* Opaque mounted file system instance */
+struct fs;
+
+/**
+ * fsi_mount - Mount a file system instance
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of FS_MOUNT_* flags, see fs_mount_flags()
+ * @cache_blocks: Number of data blocks the cache of the instance can hold
+ *
+ * Return: NULL in the same cases as fs_mount_flags() or if memory cannot be
+ * allocated, the new instance otherwise.
+ */
+struct fs *fsi_mount(const char *diskname, int flags, size_t cache_blocks);
+
+/**
+ * fsi_umount - Unmount a file system instance
+ * @fs: Instance
+ *
+ * Same as fs_umount(). When it succeeds, @fs is released, so no other thread
+ * may still be using it.
+ *
+ * Return: -1 if there are still open file descriptors or if one of the writes
+ * failed, @fs then stays mounted. 0 otherwise.
+ */
+int fsi_umount(struct fs *fs);
+
+int fsi_info(struct fs *fs);
+int fsi_create(struct fs *fs, const char *filename);
+int fsi_delete(struct fs *fs, const char *filename);
+int fsi_ls(struct fs *fs);
+int fsi_open(struct fs *fs, const char *filename);
+int fsi_close(struct fs *fs, int fd);
+int fsi_stat(struct fs *fs, int fd);
+int fsi_lseek(struct fs *fs, int fd, size_t offset);
+int fsi_write(struct fs *fs, int fd, void *buf, size_t count);
+int fsi_read(struct fs *fs, int fd, void *buf, size_t count);
+int fsi_pwrite(struct fs *fs, int fd, const void *buf, size_t count, size_t offset);
+int fsi_pread(struct fs *fs, int fd, void *buf, size_t count, size_t offset);
+int fsi_writev(struct fs *fs, int fd, const struct iovec *iov, int iovcnt);
+int fsi_readv(struct fs *fs, int fd, const struct iovec *iov, int iovcnt);
+int fsi_list(struct fs *fs, char names[][FS_FILENAME_LEN]);
+int fsi_copy_out(struct fs *fs, int fd, size_t offset, int host_fd, size_t host_offset, size_t count);
+int fsi_reserve(struct fs *fs, int fd, size_t bytes);
+int fsi_flush(struct fs *fs);
+int fsi_sync(struct fs *fs);
+int fsi_fat_budget(struct fs *fs, size_t nblocks);
+int fsi_amp(struct fs *fs, const char *filename, struct fs_amp *amp);
+int fsi_frag(struct fs *fs, struct fs_frag *frag);
+int fsi_defrag(struct fs *fs, size_t max_blocks);
+
 #endif /* _FS_H */
@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "journal.h"
+
+// First block of a transaction
+struct jrnl_desc {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;             // Number of images following the descriptor
+    uint32_t checksum;          // Of the descriptor (with checksum 0) and images
+    uint16_t blocks[JRNL_TXN_MAX];  // Home location of each image
+    char padding[BLOCK_SIZE - 16 - 2 * JRNL_TXN_MAX];
+} __attribute__((packed));
+
+// FNV-1a, continued from h
+static uint32_t checksum(uint32_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t txn_checksum(struct jrnl_desc *d, const void *const *bufs)
+{
+    uint32_t saved = d->checksum;
+    uint32_t h;
+
+    d->checksum = 0;
+    h = checksum(2166136261u, d, sizeof(*d));
+    d->checksum = saved;
+    for (size_t i = 0; i < d->count; i++) {
+        h = checksum(h, bufs[i], BLOCK_SIZE);
+    }
+    return h;
+}
+
+void journal_init(struct journal *j, struct disk *d, size_t start,
+                  size_t nblocks, uint32_t seq)
+{
+    j->disk = d;
+    j->start = start;
+    j->nblocks = nblocks;
+    j->head = 0;
+    j->seq = seq;
+    j->next_seq = seq;
+}
+
+int journal_replay(struct journal *j)
+{
+    struct jrnl_desc d;
+    char *images;
+    const void *bufs[JRNL_TXN_MAX];
+    size_t homes[JRNL_TXN_MAX];
+    int n = 0;
+
+    images = malloc(j->nblocks * BLOCK_SIZE);
+    if (images == NULL) {
+        return -1;
+    }
+
+    j->head = 0;
+    j->next_seq = j->seq;
+    while (j->head < j->nblocks) {
+        if (disk_read(j->disk, j->start + j->head, &d) == -1) {
+            goto err;
+        }
+        if (d.magic != JRNL_MAGIC || d.seq != j->next_seq || d.count == 0 ||
+            d.count > JRNL_TXN_MAX || d.count >= j->nblocks - j->head) {
+            break;
+        }
+        if (disk_read_range(j->disk, j->start + j->head + 1, d.count, images) == -1) {
+            goto err;
+        }
+        for (size_t i = 0; i < d.count; i++) {
+            homes[i] = d.blocks[i];
+            bufs[i] = images + i * BLOCK_SIZE;
+        }
+        // A torn transaction was never acknowledged, it ends the log
+        if (txn_checksum(&d, bufs) != d.checksum) {
+            break;
+        }
+        if (disk_writev(j->disk, homes, bufs, d.count) == -1) {
+            goto err;
+        }
+        j->head += 1 + d.count;
+        j->next_seq++;
+        n++;
+    }
+
+    free(images);
+    return n;
+
+err:
+    free(images);
+    return -1;
+}
+
+int journal_commit(struct journal *j, const size_t *blocks,
+                   const void *const *bufs, size_t count)
+{
+    struct jrnl_desc d;
+    size_t where[JRNL_TXN_MAX + 1];
+    const void *what[JRNL_TXN_MAX + 1];
+
+    if (count == 0 || count > journal_space(j)) {
+        return -1;
+    }
+
+    memset(&d, 0, sizeof(d));
+    d.magic = JRNL_MAGIC;
+    d.seq = j->next_seq;
+    d.count = count;
+    for (size_t i = 0; i < count; i++) {
+        d.blocks[i] = blocks[i];
+    }
+    d.checksum = txn_checksum(&d, bufs);
+
+    // Consecutive blocks, the whole transaction goes out in one request
+    where[0] = j->start + j->head;
+    what[0] = &d;
+    for (size_t i = 0; i < count; i++) {
+        where[i + 1] = j->start + j->head + 1 + i;
+        what[i + 1] = bufs[i];
+    }
+    if (disk_writev(j->disk, where, what, count + 1) == -1) {
+        return -1;
+    }
+    if (disk_sync(j->disk) == -1) {
+        return -1;
+    }
+
+    j->head += 1 + count;
+    j->next_seq++;
+
+    return 0;
+}
+
+size_t journal_space(const struct journal *j)
+{
+    size_t left = j->nblocks - j->head;
+
+    if (left <= 1) {
+        return 0;
+    }
+    return left - 1 < JRNL_TXN_MAX ? left - 1 : JRNL_TXN_MAX;
+}
+
+void journal_reset(struct journal *j)
+{
+    j->head = 0;
+    j->seq = j->next_seq;
+}
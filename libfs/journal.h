@@ -0,0 +1,94 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+struct disk;
+
+/** Magic number identifying a journal in the superblock and in descriptors */
+#define JRNL_MAGIC 0x4A524E4C
+
+/** Maximum number of block images in one transaction */
+#define JRNL_TXN_MAX 1024
+
+/*
+ * Write-ahead log of metadata blocks stored in a fixed region of the disk.
+ *
+ * A transaction is a descriptor block followed by the images of the blocks it
+ * updates. The descriptor holds the home location of every image, a sequence
+ * number and a checksum of the whole transaction. Transactions are appended
+ * until the region is full, then the caller writes the blocks home
+ * (checkpoint) and starts over at the beginning of the region with the next
+ * sequence number. Only the transactions numbered from the sequence number
+ * recorded by the caller at the last checkpoint are replayed.
+ */
+struct journal {
+    struct disk *disk;  // Disk holding the region
+    size_t start;       // First block of the region
+    size_t nblocks;     // Size of the region
+    size_t head;        // Next free block, relative to start
+    uint32_t seq;       // Sequence number of the first transaction
+    uint32_t next_seq;  // Sequence number of the next transaction
+};
+
+/**
+ * journal_init - Attach to a journal region
+ * @j: Journal
+ * @d: Disk holding the region
+ * @start: Index of the first block of the region
+ * @nblocks: Number of blocks of the region
+ * @seq: Sequence number of the first live transaction
+ */
+void journal_init(struct journal *j, struct disk *d, size_t start,
+                  size_t nblocks, uint32_t seq);
+
+/**
+ * journal_replay - Apply the committed transactions
+ * @j: Journal
+ *
+ * Scan the region from its beginning and write the images of every valid
+ * transaction to their home location, stopping at the first descriptor that
+ * has a wrong magic number, sequence number or checksum. The journal is then
+ * positioned after the last valid transaction.
+ *
+ * Return: -1 if a block cannot be read or written, the number of replayed
+ * transactions otherwise.
+ */
+int journal_replay(struct journal *j);
+
+/**
+ * journal_commit - Durably log a transaction
+ * @j: Journal
+ * @blocks: Array of @count home block indexes
+ * @bufs: Array of @count block images of %BLOCK_SIZE bytes each
+ * @count: Number of blocks, at most %JRNL_TXN_MAX
+ *
+ * The descriptor and the images are written with a single disk_writev() call
+ * and the disk is synced before returning.
+ *
+ * Return: -1 if the transaction does not fit in the free space of the journal
+ * or if a write failed. 0 otherwise.
+ */
+int journal_commit(struct journal *j, const size_t *blocks,
+                   const void *const *bufs, size_t count);
+
+/**
+ * journal_space - Free space of the journal
+ * @j: Journal
+ *
+ * Return: the largest number of block images a transaction can still hold.
+ */
+size_t journal_space(const struct journal *j);
+
+/**
+ * journal_reset - Empty the journal after a checkpoint
+ * @j: Journal
+ *
+ * Must only be called once every logged block is durable at its home location.
+ * The caller must then record the new first sequence number, @j->seq, so that
+ * the discarded transactions are not replayed.
+ */
+void journal_reset(struct journal *j);
+
+#endif /* _JOURNAL_H */
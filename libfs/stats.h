@@ -0,0 +1,84 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+
+/*
+ * Instrumentation helpers. Unless FS_STATS is defined, they expand to nothing
+ * and the library carries no counting or timing code at all.
+ */
+
+#ifdef FS_STATS
+
+#include <time.h>
+
+#include "disk.h"
+
+/** STATS_ADD - Add @n to the 64-bit counter @var, shared between threads */
+#define STATS_ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
+/** STATS_START - Declare mark @m for an operation starting now */
+#define STATS_START(m) struct stats_mark m = stats_mark()
+
+/** STATS_ARGS - Record the arguments of the operation of mark @m */
+#define STATS_ARGS(m, fd_, arg_, name_) \
+    ((m).fd = (fd_), (m).arg = (arg_), (m).name = (name_))
+
+/** STATS_OFFSET - Record the file offset the operation of mark @m starts at */
+#define STATS_OFFSET(m, offset_) ((m).offset = (offset_))
+
+/*
+ * Start of an operation, to account for its duration and disk traffic, and
+ * arguments to trace it
+ */
+struct stats_mark {
+    uint64_t ns;        // Monotonic time, in nanoseconds
+    uint64_t reads;     // Blocks read by the calling thread so far
+    uint64_t writes;    // Blocks written by the calling thread so far
+    int fd;             // File descriptor, -1 if none
+    uint64_t arg;       // Byte count, offset or flags
+    uint64_t offset;    // File offset
+    const char *name;   // File name, NULL if none
+};
+
+/**
+ * stats_now - Get a timestamp
+ *
+ * Return: the current time of the monotonic clock, in nanoseconds.
+ */
+static inline uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * stats_mark - Get a mark for an operation starting now
+ *
+ * Return: the current time and disk counters of the calling thread.
+ */
+static inline struct stats_mark stats_mark(void)
+{
+    struct stats_mark m;
+
+    m.ns = stats_now();
+    disk_thread_stats(&m.reads, &m.writes);
+    m.fd = -1;
+    m.arg = 0;
+    m.offset = 0;
+    m.name = NULL;
+    return m;
+}
+
+#else
+
+#define STATS_ADD(var, n) do { } while (0)
+#define STATS_START(m) do { } while (0)
+#define STATS_ARGS(m, fd_, arg_, name_) do { } while (0)
+#define STATS_OFFSET(m, offset_) do { } while (0)
+
+#endif /* FS_STATS */
+
+#endif /* _STATS_H */
@@ -0,0 +1,93 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_BUF_SIZE (1 << 20)
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static char *trace_buf;
+static int trace_on;
+static uint64_t trace_start;
+static uint32_t trace_tids;
+static __thread uint32_t trace_tid;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int trace_open(const char *path)
+{
+    struct trace_hdr hdr = { TRACE_MAGIC, TRACE_VERSION };
+    int ret = -1;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file == NULL) {
+        trace_file = fopen(path, "w");
+    } else {
+        path = NULL;
+    }
+    if (path != NULL && trace_file != NULL) {
+        // Fully buffered, records only reach the file by large chunks
+        trace_buf = malloc(TRACE_BUF_SIZE);
+        if (trace_buf != NULL) {
+            setvbuf(trace_file, trace_buf, _IOFBF, TRACE_BUF_SIZE);
+        }
+        fwrite(&hdr, sizeof(hdr), 1, trace_file);
+        trace_start = now_ns();
+        __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    return ret;
+}
+
+int trace_close(void)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+        ret = fclose(trace_file) == 0 ? 0 : -1;
+        trace_file = NULL;
+        free(trace_buf);
+        trace_buf = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    return ret;
+}
+
+int trace_active(void)
+{
+    return __atomic_load_n(&trace_on, __ATOMIC_ACQUIRE);
+}
+
+uint64_t trace_since(uint64_t ns)
+{
+    return ns > trace_start ? ns - trace_start : 0;
+}
+
+void trace_write(struct trace_rec *rec, const char *name)
+{
+    if (trace_tid == 0) {
+        trace_tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+    }
+    rec->tid = trace_tid;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        fwrite(rec, sizeof(*rec), 1, trace_file);
+        fwrite(name, 1, rec->name_len, trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
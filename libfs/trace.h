@@ -0,0 +1,81 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary trace of the fs_* calls, written by fs_trace_start() and read back
+ * by apps/replay_fs.x.
+ *
+ * A trace is a struct trace_hdr followed by one struct trace_rec per call, in
+ * the order the calls returned. A record is followed by @name_len bytes of
+ * file name (without NULL terminator) for fs_create(), fs_delete() and
+ * fs_open(). All the fields are in host byte order.
+ */
+
+/** Magic number at the beginning of a trace */
+#define TRACE_MAGIC 0x43525446  /* "FTRC" */
+
+/** Version of the record format */
+#define TRACE_VERSION 1
+
+struct trace_hdr {
+    uint32_t magic;
+    uint32_t version;
+} __attribute__((packed));
+
+struct trace_rec {
+    uint64_t start_ns;  // Start of the call, since the trace was started
+    uint64_t arg;       // Byte count, offset, or mount flags
+    uint64_t offset;    // File offset fs_read(), fs_write() and co. start at
+    uint32_t dur_ns;    // Duration of the call, saturated at UINT32_MAX
+    int32_t ret;        // Value returned by the call
+    uint32_t tid;       // Calling thread, numbered from 1 in the trace
+    int16_t fd;         // File descriptor argument, -1 if none
+    uint8_t op;         // One of enum fs_stats_op
+    uint8_t name_len;   // Length of the file name following the record
+} __attribute__((packed));
+
+/**
+ * trace_open - Start writing a trace
+ * @path: Name of the trace file, created or truncated
+ *
+ * Return: -1 if a trace is already being written or if @path cannot be
+ * created. 0 otherwise.
+ */
+int trace_open(const char *path);
+
+/**
+ * trace_close - Stop writing the trace
+ *
+ * Return: -1 if no trace is being written or if the buffered records cannot
+ * be written. 0 otherwise.
+ */
+int trace_close(void);
+
+/**
+ * trace_active - Tell whether a trace is being written
+ *
+ * Cheap enough to be checked on every call.
+ */
+int trace_active(void);
+
+/**
+ * trace_since - Convert a timestamp to trace time
+ * @ns: Monotonic time, in nanoseconds
+ *
+ * Return: the time elapsed between the start of the trace and @ns.
+ */
+uint64_t trace_since(uint64_t ns);
+
+/**
+ * trace_write - Append a record
+ * @rec: Record, its @tid is filled in
+ * @name: @rec->name_len bytes of file name
+ *
+ * Records are buffered and written in large chunks. Nothing is done if no
+ * trace is being written.
+ */
+void trace_write(struct trace_rec *rec, const char *name);
+
+#endif /* _TRACE_H */
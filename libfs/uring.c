@@ -0,0 +1,268 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Shared ring state, as laid out by the kernel in the mmap'ed regions */
+struct uring {
+	int ring_fd;
+	int fd;
+	unsigned sq_entries;
+	/* Call of uring_rw() the submitted transfers belong to */
+	uint32_t gen;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+struct uring *uring_create(int fd)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	char *sq, *cq;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = sys_io_uring_setup(URING_DEPTH, &p);
+	if (u->ring_fd < 0) {
+		free(u);
+		return NULL;
+	}
+	u->fd = fd;
+	u->sq_entries = p.sq_entries;
+
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* Recent kernels share a single mapping for both rings */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = 0;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->ring_fd,
+			  IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (u->cq_ring_sz) {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->ring_fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto err_sq;
+	} else {
+		u->cq_ring = u->sq_ring;
+	}
+
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err_cq;
+
+	sq = u->sq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	cq = u->cq_ring;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return u;
+
+err_cq:
+	if (u->cq_ring_sz)
+		munmap(u->cq_ring, u->cq_ring_sz);
+err_sq:
+	munmap(u->sq_ring, u->sq_ring_sz);
+err_close:
+	close(u->ring_fd);
+	free(u);
+	return NULL;
+}
+
+void uring_destroy(struct uring *u)
+{
+	if (!u)
+		return;
+
+	munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring_sz)
+		munmap(u->cq_ring, u->cq_ring_sz);
+	munmap(u->sq_ring, u->sq_ring_sz);
+	close(u->ring_fd);
+	free(u);
+}
+
+/* Queue transfer @i in the next free submission queue entry */
+static void uring_queue(struct uring *u, int write_op, struct uring_op *ops,
+			size_t i)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write_op ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = u->fd;
+	sqe->addr = (unsigned long)ops[i].iov;
+	sqe->len = ops[i].iovcnt;
+	sqe->off = ops[i].offset;
+	/* Tag the transfer with the current call, completions of an earlier
+	 * call must not index this call's @ops */
+	sqe->user_data = (uint64_t)u->gen << 32 | i;
+
+	u->sq_array[idx] = idx;
+	/* Publish the entry once it is fully written */
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Collect every available completion, return how many of the current call
+ * were collected */
+static unsigned uring_reap(struct uring *u, struct uring_op *ops, size_t count)
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned n = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		uint64_t i = cqe->user_data & UINT32_MAX;
+
+		/* Stale completions are dropped */
+		if (cqe->user_data >> 32 == u->gen && i < count) {
+			ops[i].res = cqe->res;
+			n++;
+		}
+		head++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/*
+ * Give up on a batch: withdraw the @queued entries the kernel has not consumed
+ * and wait for the @inflight ones, whose buffers the kernel may still access
+ */
+static int uring_abort(struct uring *u, struct uring_op *ops, size_t count,
+		       unsigned queued, unsigned inflight)
+{
+	/* Without SQPOLL, the kernel only reads the queue in io_uring_enter() */
+	__atomic_store_n(u->sq_tail, *u->sq_tail - queued, __ATOMIC_RELEASE);
+
+	while (inflight > 0) {
+		if (sys_io_uring_enter(u->ring_fd, 0, inflight,
+				       IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			return URING_BROKEN;
+		inflight -= uring_reap(u, ops, count);
+	}
+
+	return -1;
+}
+
+int uring_rw(struct uring *u, int write_op, struct uring_op *ops, size_t count)
+{
+	size_t next = 0, done = 0;
+	unsigned queued = 0, inflight = 0;
+
+	u->gen++;
+	while (done < count) {
+		int ret;
+
+		/* Keep the submission queue as full as possible */
+		while (next < count && queued + inflight < u->sq_entries) {
+			uring_queue(u, write_op, ops, next++);
+			queued++;
+		}
+
+		ret = sys_io_uring_enter(u->ring_fd, queued, 1,
+					 IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return uring_abort(u, ops, count, queued, inflight);
+		}
+		if (ret == 0 && inflight == 0 && queued > 0)
+			return uring_abort(u, ops, count, queued, inflight);
+		queued -= ret;
+		inflight += ret;
+
+		ret = uring_reap(u, ops, count);
+		inflight -= ret;
+		done += ret;
+	}
+
+	return 0;
+}
+
+#else /* no io_uring */
+
+struct uring *uring_create(int fd)
+{
+	(void)fd;
+	return NULL;
+}
+
+void uring_destroy(struct uring *u)
+{
+	(void)u;
+}
+
+int uring_rw(struct uring *u, int write_op, struct uring_op *ops, size_t count)
+{
+	(void)u;
+	(void)write_op;
+	(void)ops;
+	(void)count;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
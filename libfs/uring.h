@@ -0,0 +1,63 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** Number of submission queue entries of a ring */
+#define URING_DEPTH 64
+
+/** uring_rw() result when transfers may still be running after a failure */
+#define URING_BROKEN -2
+
+/* One vectored transfer submitted to the ring */
+struct uring_op {
+	/* Buffers and number of buffers */
+	struct iovec *iov;
+	int iovcnt;
+	/* Position in the file */
+	off_t offset;
+	/* Result of the transfer, as returned by preadv()/pwritev() or -errno */
+	ssize_t res;
+};
+
+/* Opaque io_uring instance */
+struct uring;
+
+/**
+ * uring_create - Set up an io_uring instance
+ * @fd: File descriptor the transfers will target
+ *
+ * Return: NULL if io_uring is not supported by the kernel (or not allowed),
+ * the new ring otherwise.
+ */
+struct uring *uring_create(int fd);
+
+/**
+ * uring_destroy - Tear down an io_uring instance
+ * @u: Ring to destroy, can be NULL
+ */
+void uring_destroy(struct uring *u);
+
+/**
+ * uring_rw - Run a batch of vectored transfers
+ * @u: Ring
+ * @write_op: 1 to write the buffers, 0 to read into them
+ * @ops: Array of @count transfers
+ * @count: Number of transfers
+ *
+ * Keep up to %URING_DEPTH transfers in flight until all of them completed.
+ * The result of each transfer is stored in its @res field, short transfers
+ * are left to the caller.
+ *
+ * If the ring fails, the transfers already submitted are waited for before
+ * returning, so that the kernel no longer accesses the buffers.
+ *
+ * Return: -1 if the ring itself failed (the @res fields are then meaningless),
+ * %URING_BROKEN if the submitted transfers could not be waited for: their
+ * buffers may still be accessed and the ring must not be used again.
+ * 0 otherwise.
+ */
+int uring_rw(struct uring *u, int write_op, struct uring_op *ops, size_t count);
+
+#endif /* _URING_H */